@@ -0,0 +1,97 @@
+// microbenchmark of the split-block BloomFilter against the classic layout
+// it replaced (std::vector<bool>, k probes placed by double hashing), both
+// sized at the same bits per key. Build from src/ with `make bloom_bench`.
+#include "../include/kv/bloomfilter.hpp"
+#include "../include/kv/hash_func.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// the filter segments used before the split-block one
+class ClassicBloom {
+  std::vector<bool> bits;
+  size_t m, k;
+
+public:
+  ClassicBloom(size_t bitsize, size_t numHashes)
+      : bits(bitsize), m(bitsize), k(numHashes) {}
+  void add(uint64_t hash) {
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | (hash << 32);
+    for (size_t i = 0; i < k; ++i) {
+      bits[(h1 + i * h2) % m] = true;
+    }
+  }
+  bool maybeContains(uint64_t hash) const {
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | (hash << 32);
+    for (size_t i = 0; i < k; ++i) {
+      if (!bits[(h1 + i * h2) % m])
+        return false;
+    }
+    return true;
+  }
+};
+
+static std::vector<uint64_t> hashes(const std::string &prefix, size_t n) {
+  std::vector<uint64_t> out(n);
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = kv::fnv1a(prefix + std::to_string(i));
+  }
+  return out;
+}
+
+// nanoseconds per call and how many calls said "maybe"
+template <typename Filter>
+static double probe(const Filter &f, const std::vector<uint64_t> &keys,
+                    size_t &hits) {
+  auto start = std::chrono::steady_clock::now();
+  hits = 0;
+  for (uint64_t h : keys) {
+    hits += f.maybeContains(h);
+  }
+  auto ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  return ns / keys.size();
+}
+
+int main() {
+  const size_t probes = 2'000'000;
+  std::vector<uint64_t> missing = hashes("missing_", probes);
+  std::cout << "keys\tfilter\tbits/key\tmiss ns\thit ns\tfp %\n";
+
+  for (size_t n : {100'000ul, 1'000'000ul, 10'000'000ul}) {
+    std::vector<uint64_t> present = hashes("key_", n);
+    std::vector<uint64_t> present_probe(present.begin(),
+                                        present.begin() + std::min(n, probes));
+
+    kv::BloomFilter block = kv::BloomFilter::forKeys(n, {0, 0.01});
+    for (uint64_t h : present) {
+      block.add(h);
+    }
+    double bpk = static_cast<double>(block.size()) / n;
+    ClassicBloom classic(block.size(),
+                         static_cast<size_t>(std::lround(bpk * std::log(2))));
+    for (uint64_t h : present) {
+      classic.add(h);
+    }
+
+    auto report = [&](const char *name, auto &f) {
+      size_t fp, hits;
+      double miss_ns = probe(f, missing, fp);
+      double hit_ns = probe(f, present_probe, hits);
+      if (hits != present_probe.size())
+        std::cout << "false negative in " << name << "\n";
+      std::cout << n << '\t' << name << '\t' << bpk << "\t\t" << miss_ns
+                << '\t' << hit_ns << '\t' << 100.0 * fp / probes << '\n';
+    };
+    report("classic", classic);
+    report("block", block);
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+// microbenchmark of the record checksums: the byte-at-a-time CRC-32 records
+// used to carry against the slicing-by-8 CRC-32 and the dispatched CRC32C
+// that replaced it. Build from src/ with `make crc_bench`.
+#include "../include/kv/utils.hpp"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// the checksum segments used before slicing-by-8
+static uint32_t crc32Bytewise(const uint8_t *data, size_t length) {
+  static const std::array<uint32_t, 256> table = [] {
+    std::array<uint32_t, 256> t{};
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+      t[i] = crc;
+    }
+    return t;
+  }();
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < length; ++i)
+    crc = (crc >> 8) ^ table[static_cast<uint8_t>(crc ^ data[i])];
+  return crc ^ 0xFFFFFFFFu;
+}
+
+// GB/s over records of size bytes, sum keeps the calls from being dropped
+template <typename Fn>
+static double throughput(Fn fn, const std::vector<uint8_t> &buf, size_t size,
+                         uint32_t &sum) {
+  size_t records = buf.size() / size;
+  size_t rounds = std::max<size_t>(1, (256u << 20) / buf.size());
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (size_t i = 0; i < records; ++i)
+      sum += fn(buf.data() + i * size, size);
+  }
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           start)
+                 .count();
+  return static_cast<double>(rounds * records * size) / s / 1e9;
+}
+
+int main() {
+  std::vector<uint8_t> buf(16 << 20);
+  std::mt19937_64 rng(42);
+  for (auto &b : buf)
+    b = static_cast<uint8_t>(rng());
+
+  // known answers for "123456789"
+  const auto *check = reinterpret_cast<const uint8_t *>("123456789");
+  if (utils::crc32(check, 9) != 0xCBF43926u ||
+      utils::crc32c(check, 9) != 0xE3069283u)
+    std::cout << "wrong checksum\n";
+
+  std::cout << "record bytes\tbytewise GB/s\tslice-8 GB/s\tcrc32c GB/s\n";
+  uint32_t sum = 0;
+  for (size_t size : {64ul, 512ul, 4096ul, 65536ul, 1ul << 20}) {
+    double old = throughput(crc32Bytewise, buf, size, sum);
+    double sliced = throughput(utils::crc32, buf, size, sum);
+    double castagnoli = throughput(utils::crc32c, buf, size, sum);
+    std::cout << size << "\t\t" << old << "\t\t" << sliced << "\t\t"
+              << castagnoli << '\n';
+  }
+  return sum == 42 ? 1 : 0;
+}
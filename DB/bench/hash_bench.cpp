@@ -0,0 +1,110 @@
+// microbenchmark of the key hashes on the kinds of keys the engine sees:
+// throughput, and how evenly they spread over keydir stripes (low bits) and
+// hash table buckets (top bits after the fibonacci multiply). Build from src/
+// with `make hash_bench`.
+#include "../include/kv/hash_func.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// chi-squared over the expected count per bucket divided by the degrees of
+// freedom, about 1 for a uniform spread and far above it for clustering
+static double spread(const std::vector<uint64_t> &hashes, unsigned bits,
+                     bool top) {
+  size_t buckets = size_t{1} << bits;
+  std::vector<size_t> count(buckets);
+  for (uint64_t h : hashes) {
+    size_t b = top ? static_cast<size_t>((h * 0x9E3779B97F4A7C15ull) >>
+                                         (64 - bits))
+                   : static_cast<size_t>(h & (buckets - 1));
+    ++count[b];
+  }
+  double expected = static_cast<double>(hashes.size()) / buckets, chi = 0;
+  for (size_t c : count)
+    chi += (c - expected) * (c - expected) / expected;
+  return chi / (buckets - 1);
+}
+
+// nanoseconds per key, every hash kept for the spread. The keys are laid out
+// back to back first so the timing is the hash and not pointer chasing
+static double timeHash(kv::HashFn fn, const std::vector<std::string> &strings,
+                       std::vector<uint64_t> &out) {
+  std::string arena;
+  for (const auto &k : strings)
+    arena += k;
+  std::vector<std::string_view> keys;
+  size_t at = 0;
+  for (const auto &k : strings) {
+    keys.emplace_back(arena.data() + at, k.size());
+    at += k.size();
+  }
+  const int rounds = 5;
+  out.resize(keys.size());
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; ++r) {
+    for (size_t i = 0; i < keys.size(); ++i)
+      out[i] = fn(keys[i]);
+  }
+  auto ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  return ns / (rounds * keys.size());
+}
+
+int main() {
+  const size_t n = 1'000'000;
+  std::mt19937_64 rng(42);
+  auto word = [&] {
+    std::string w(3 + rng() % 10, 'a');
+    for (auto &c : w)
+      c = static_cast<char>('a' + rng() % 26);
+    return w;
+  };
+  auto hex = [&] {
+    static const char digits[] = "0123456789abcdef";
+    std::string h(16, '0');
+    for (auto &c : h)
+      c = digits[rng() % 16];
+    return h;
+  };
+
+  struct KeySet {
+    const char *name;
+    std::vector<std::string> keys;
+  };
+  std::vector<KeySet> sets = {{"numeric ids", {}},
+                              {"model ids", {}},
+                              {"index terms", {}},
+                              {"index docs", {}}};
+  for (size_t i = 0; i < n; ++i) {
+    sets[0].keys.push_back(std::to_string(i));
+    sets[1].keys.push_back("users:" + hex());
+    sets[2].keys.push_back("search_index:t:" + word());
+    sets[3].keys.push_back("search_index:d:order-2024-" + std::to_string(i));
+  }
+  // terms repeat, and a repeated key is not a collision
+  auto &terms = sets[2].keys;
+  std::sort(terms.begin(), terms.end());
+  terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+  std::cout << "keys\t\thash\tns/key\tstripes\tlow 16\ttop 20\n";
+  std::vector<uint64_t> hashes;
+  for (const auto &set : sets) {
+    for (auto [name, fn] : {std::pair<const char *, kv::HashFn>{"fnv1a",
+                                                                kv::fnv1a},
+                            {"wyhash", kv::wyhash}}) {
+      double ns = timeHash(fn, set.keys, hashes);
+      std::cout << set.name << '\t' << name << '\t' << ns << '\t'
+                << spread(hashes, 6, false) << '\t'
+                << spread(hashes, 16, false) << '\t'
+                << spread(hashes, 20, true) << '\n';
+    }
+  }
+  return 0;
+}
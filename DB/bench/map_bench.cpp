@@ -0,0 +1,116 @@
+// microbenchmark of RobinHoodMap, the keydir's table, against
+// std::unordered_map on keydir-like string keys and 16 byte values. Every
+// phase is also checked against the std::unordered_map, a wrong answer ends
+// the run. Build from src/ with `make map_bench`.
+#include "../include/kv/hash_func.hpp"
+#include "../include/kv/robin_hood_map.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct Location {
+  uint64_t offset;
+  uint32_t segment_id;
+  uint32_t size;
+};
+
+struct Hash {
+  size_t operator()(const std::string &s) const { return kv::wyhash(s); }
+};
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    std::cerr << "mismatch in " << what << '\n';
+    std::exit(1);
+  }
+}
+
+int main() {
+  const size_t n = 2'000'000;
+  std::mt19937_64 rng(7);
+  std::vector<std::string> keys, misses;
+  for (size_t i = 0; i < n; ++i) {
+    keys.push_back("user:" + std::to_string(rng()));
+    misses.push_back("order:" + std::to_string(rng()));
+  }
+  std::vector<uint64_t> hashes, miss_hashes;
+  for (size_t i = 0; i < n; ++i) {
+    hashes.push_back(kv::wyhash(keys[i]));
+    miss_hashes.push_back(kv::wyhash(misses[i]));
+  }
+
+  kv::RobinHoodMap<std::string, Location> map;
+  std::unordered_map<std::string, Location, Hash> ref;
+
+  auto t = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i)
+    map.put(keys[i], hashes[i], {i, 1, 64});
+  double insert_ms = msSince(t);
+  t = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i)
+    ref[keys[i]] = {i, 1, 64};
+  double ref_insert_ms = msSince(t);
+  check(map.size() == ref.size(), "insert");
+
+  // hits and misses interleaved, the way lookups of a mixed workload land
+  size_t found = 0, ref_found = 0;
+  t = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    found += map.get(keys[i], hashes[i]).has_value();
+    found += map.get(misses[i], miss_hashes[i]).has_value();
+  }
+  double lookup_ms = msSince(t);
+  t = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    ref_found += ref.count(keys[i]);
+    ref_found += ref.count(misses[i]);
+  }
+  double ref_lookup_ms = msSince(t);
+  check(found == n && ref_found == n, "lookup");
+
+  // erase every other key and put the misses in, the churn of overwrites
+  // and deletes the keydir sees between compactions
+  t = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i += 2) {
+    map.erase(keys[i], hashes[i]);
+    map.put(misses[i], miss_hashes[i], {i, 2, 64});
+  }
+  double churn_ms = msSince(t);
+  t = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i += 2) {
+    ref.erase(keys[i]);
+    ref[misses[i]] = {i, 2, 64};
+  }
+  double ref_churn_ms = msSince(t);
+  check(map.size() == ref.size(), "churn size");
+  for (size_t i = 0; i < n; ++i) {
+    auto got = map.get(keys[i], hashes[i]);
+    auto it = ref.find(keys[i]);
+    check(got.has_value() == (it != ref.end()), "churn keys");
+    if (got)
+      check(got->offset == it->second.offset, "churn values");
+    check(map.get(misses[i], miss_hashes[i]).has_value() == (i % 2 == 0),
+          "churn misses");
+  }
+
+  std::cout << n << " keys, ms            RobinHoodMap  unordered_map\n";
+  std::cout << "insert                      " << insert_ms << "  "
+            << ref_insert_ms << '\n';
+  std::cout << "lookup (hits + misses)      " << lookup_ms << "  "
+            << ref_lookup_ms << '\n';
+  std::cout << "erase + insert (half)       " << churn_ms << "  "
+            << ref_churn_ms << '\n';
+}
@@ -4,20 +4,60 @@
 #include <vector>
 
 namespace kv {
+
+// how filters get sized: enough bits for the keys they hold at fp_rate, but
+// never fewer than min_bits
+struct BloomSizing {
+  size_t min_bits = 8 * 1024;
+  double fp_rate = 0.01;
+};
+
+// split-block bloom filter: a key picks one 256-bit block and sets one bit in
+// each of its eight 32-bit words, so a probe touches a single cache line no
+// matter how big the filter is. It needs a few more bits per key than a
+// classic filter for the same false positive rate, which forKeys accounts for
 class BloomFilter {
-  std::vector<bool> bits;
-  size_t m, k;
+public:
+  static constexpr size_t BLOCK_BITS = 256;
+  static constexpr size_t WORDS = 8; // words per block, one bit set in each
+
+private:
+  struct alignas(32) Block {
+    uint32_t w[WORDS];
+  };
+  std::vector<Block> blocks;
+  size_t cap; // keys it was sized for
+
+  // keys arrive hashed with the model's hash, and fnv1a's halves are too
+  // weak on their own for picking both a block and the bits in it, so they
+  // get remixed first
+  static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+  }
+  size_t blockFor(uint64_t hash) const {
+    return static_cast<size_t>(((hash >> 32) * blocks.size()) >> 32);
+  }
 
 public:
-  BloomFilter(size_t bitsize, size_t numHashes);
+  BloomFilter(size_t bitsize, size_t capacity);
+  // a filter holding `keys` keys at the false positive rate of sizing
+  static BloomFilter forKeys(size_t keys, const BloomSizing &sizing);
   void add(uint64_t hash);
   bool maybeContains(uint64_t hash) const;
-  size_t getNumHashes() const { return k; }
-  size_t size() const { return m; }
+  size_t size() const { return blocks.size() * BLOCK_BITS; }
+  // keys it takes before the false positive rate drifts past the target
+  size_t capacity() const { return cap; }
 
-  // low level implementation to access the funcitons
-  void setBit(size_t idx, bool v) { bits[idx] = v; }
-  bool getBit(size_t idx) const { return bits[idx]; }
+  // raw blocks, used to save and load the filter in one go
+  char *data() { return reinterpret_cast<char *>(blocks.data()); }
+  const char *data() const {
+    return reinterpret_cast<const char *>(blocks.data());
+  }
+  size_t byteSize() const { return blocks.size() * sizeof(Block); }
 };
 
 } // namespace kv
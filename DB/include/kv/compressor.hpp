@@ -0,0 +1,64 @@
+#pragma once
+#include "config.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+namespace kv {
+
+// how one record's value is stored, kept in RecordHeader::codec
+enum class Codec : uint8_t {
+  Raw = 0,     // as written
+  LZ4 = 1,     // LZ4 block behind the original length (u32)
+  Zstd = 2,    // zstd frame
+  ZstdDict = 3 // zstd frame against the model's dictionary
+};
+
+// compresses values on their way to a segment and back, one per model,
+// shared by its shards. Values too small to win anything stay raw.
+//
+// The zstd dictionary is raw content: the first values of the model, up to
+// compression_dict_kb, saved once to the model's DICT file. JSON documents of
+// one model repeat the same field names and shapes, so even small values find
+// most of their bytes in it. Values written before it existed keep plain zstd
+// frames, the dictionary never changes once saved
+class Compressor {
+  static constexpr size_t MIN_BYTES = 32;      // smaller values stay raw
+  static constexpr size_t SAMPLE_BYTES = 1024; // taken from each value
+
+  struct Dictionary {
+    std::string bytes;
+    ZSTD_CDict_s *cdict = nullptr;
+    ZSTD_DDict_s *ddict = nullptr;
+    Dictionary(std::string bytes);
+    ~Dictionary();
+  };
+
+  Compression mode;
+  std::string dict_path;
+  std::atomic<size_t> dict_size; // 0 once saving the dictionary failed
+  std::shared_ptr<const Dictionary> dict; // std::atomic_load/store
+  std::mutex sample_mu;                   // guards samples
+  std::string samples; // dictionary being collected, until it is saved
+
+  void sample(std::string_view val);
+
+public:
+  Compressor(const std::string &dir, const Config &conf);
+  // compresses val into out and returns how, Codec::Raw (out untouched) when
+  // compressing is off or does not make it smaller
+  Codec compress(std::string_view val, std::string &out);
+  // the original bytes of a value stored as codec, false if they do not
+  // decode
+  bool decompress(Codec codec, std::string_view stored,
+                  std::string &out) const;
+};
+
+} // namespace kv
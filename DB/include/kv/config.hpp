@@ -4,16 +4,58 @@
 
 namespace kv {
 
-// the main config object
+// how hard a write batch is pushed to disk before the puts in it return
+enum class Durability {
+  None,  // handed to the kernel, never synced by us
+  Flush, // handed to the kernel per batch, synced when a segment is sealed
+  Sync   // fdatasync after every batch
+};
+
+// how new values are compressed before they are written, reads handle every
+// codec whatever is configured
+enum class Compression {
+  None, // stored as given
+  LZ4,  // fast, about half the ratio of zstd on JSON
+  Zstd  // better ratio, against a per-model dictionary once there is one
+};
+
+// how keys are hashed, for the keydir, bloom filters and shard placement. A
+// model keeps the one it was created with, see StorageEngine
+enum class HashAlgo {
+  Fnv1a, // one multiply per byte, what models used before wyhash
+  WyHash // 8-48 bytes per step
+};
+
+// the main config object, defaults mirror the ones used by Config::load
 struct Config {
-  std::string data_dir;  // the directory where all the segments will live
-  size_t segment_size;   // the size of each segments
-  std::string file_ext;  // extension of the file
-  std::string index_ext; // new
-  std::string bloom_ext; // new
-  size_t bloom_bits_kb;  // new
-  size_t bloom_hashes;   // new
-  size_t thread_pool_sz; // new
+  std::string data_dir = "./data";           // the directory where all the
+                                             // segments will live
+  size_t segment_size = 64 * 1024 * 1024;    // the size of each segments
+  std::string file_ext = ".kv";              // extension of the file
+  std::string index_ext = ".idx";            // new
+  std::string bloom_ext = ".bf";             // new
+  size_t bloom_bits_kb = 8;                  // smallest filter, in Kbits
+  double bloom_fp_rate = 0.01;               // target false positive rate,
+                                             // sets bits and probes per key
+  size_t thread_pool_sz = 4;                 // new
+  double compaction_dead_ratio = 0.5;        // dead/total bytes that marks a
+                                             // segment for compaction, <= 0
+                                             // turns compaction off
+  Durability durability = Durability::Flush; // sync policy of write batches
+  size_t shards = 1;                         // independent segment sets per
+                                             // model, fixed once data exists
+  size_t cache_size_mb = 32;                 // hot value cache per model,
+                                             // 0 turns it off
+  bool ordered_index = true;                 // keys kept sorted in memory
+                                             // for scan/range
+  Compression compression = Compression::None; // codec for new values
+  size_t compression_dict_kb = 16;           // zstd dictionary taken from a
+                                             // model's first values, 0
+                                             // turns it off
+  HashAlgo hash = HashAlgo::WyHash;          // for new models only
+  bool verify_reads = true;                  // point reads check the record
+                                             // crc, scans and compaction
+                                             // always do
   static Config load(std::string conf_path);
 };
 
@@ -1,11 +1,14 @@
 #pragma once
+#include "config.hpp"
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <string_view>
 
 namespace kv {
 
 // for base, we will get started with the FNV-1a non-cryptographic hahsing
-// algorithm
+// algorithm. One multiply per byte, models created before wyhash keep it
 inline uint64_t fnv1a(std::string_view s) {
   uint64_t hash = 14695981039346656037ull;
   for (auto c : s) {
@@ -14,4 +17,89 @@ inline uint64_t fnv1a(std::string_view s) {
   }
   return hash;
 }
+
+namespace detail {
+inline uint64_t wyr8(const uint8_t *p) {
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+inline uint64_t wyr4(const uint8_t *p) {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+inline uint64_t wyr3(const uint8_t *p, size_t k) {
+  return (uint64_t(p[0]) << 16) | (uint64_t(p[k >> 1]) << 8) | p[k - 1];
+}
+// 64x64 -> 128 multiply, low half in a and high half in b
+inline void wymum(uint64_t &a, uint64_t &b) {
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  a = static_cast<uint64_t>(r);
+  b = static_cast<uint64_t>(r >> 64);
+}
+inline uint64_t wymix(uint64_t a, uint64_t b) {
+  wymum(a, b);
+  return a ^ b;
+}
+} // namespace detail
+
+// wyhash (final version 4, seed 0, default secret): 8 to 48 bytes per step
+// folded through 128 bit multiplies, so long keys like search_index:<term>
+// cost a few multiplies instead of one per byte. Words are read little-endian
+// like the reference implementation does on x86
+inline uint64_t wyhash(std::string_view s) {
+  using namespace detail;
+  static constexpr uint64_t secret[4] = {
+      0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+      0x4d5a2da51de1aa47ull};
+  const auto *p = reinterpret_cast<const uint8_t *>(s.data());
+  size_t len = s.size();
+  uint64_t seed = wymix(secret[0], secret[1]);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      size_t mid = (len >> 3) << 2;
+      a = (wyr4(p) << 32) | wyr4(p + mid);
+      b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(wyr8(p) ^ secret[1], wyr8(p + 8) ^ seed);
+        see1 = wymix(wyr8(p + 16) ^ secret[2], wyr8(p + 24) ^ see1);
+        see2 = wymix(wyr8(p + 32) ^ secret[3], wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wymix(wyr8(p) ^ secret[1], wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
+  }
+  a ^= secret[1];
+  b ^= seed;
+  wymum(a, b);
+  return wymix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+using HashFn = uint64_t (*)(std::string_view);
+
+// the function behind a HashAlgo
+inline HashFn hashFunc(HashAlgo algo) {
+  return algo == HashAlgo::Fnv1a ? fnv1a : wyhash;
+}
+
 } // namespace kv
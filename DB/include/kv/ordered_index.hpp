@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+// called with each key of a range in order, returning false stops the walk
+using KeyVisitor = std::function<bool(std::string_view)>;
+
+// the keys of a segment set in sorted order, next to the keydir which only
+// knows them by hash. It is a B+-tree cut down to two levels: sorted leaves of
+// at most LEAF_KEYS keys, found by a binary search over the first key of each
+// leaf. A range walk is one search and then a sequential read of the leaves,
+// so it costs O(log n + matches)
+class OrderedIndex {
+  static constexpr size_t LEAF_KEYS = 128;
+
+  std::vector<std::vector<std::string>> leaves; // none of them is empty
+  size_t count = 0;
+
+  size_t leafFor(std::string_view key) const;
+
+public:
+  void insert(std::string_view key);
+  void erase(std::string_view key);
+  // replaces the contents with keys, which must be sorted and unique
+  void build(std::vector<std::string> keys);
+  // the keys in [start, end), an empty end runs to the last key
+  void range(std::string_view start, std::string_view end,
+             const KeyVisitor &visit) const;
+  size_t size() const { return count; }
+};
+
+} // namespace kv
@@ -0,0 +1,150 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+// one document of a term's posting list
+struct Posting {
+  uint32_t doc; // ordinal of the document, see SearchIndex
+  uint32_t tf;  // how often the term occurs in it
+};
+
+// LEB128: 7 bits per byte, the high bit says another byte follows
+inline void putVarint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+// reads one varint off the front of in, false if it is cut short
+inline bool getVarint(std::string_view &in, uint64_t &v) {
+  v = 0;
+  for (size_t i = 0, shift = 0; i < in.size() && shift < 64; i++, shift += 7) {
+    uint8_t b = static_cast<uint8_t>(in[i]);
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      in.remove_prefix(i + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+// the stored form of a posting list, ordered by doc ordinal:
+//
+//   [count u32][last doc u32] then per posting [doc - previous doc][tf]
+//
+// both per-posting fields are varints, so a posting usually takes 2 bytes.
+// Count and last doc are fixed width, adding a document with a higher ordinal
+// than any before (the common case, ordinals are handed out in order) only
+// rewrites them and appends to the tail
+class PostingList {
+  static constexpr size_t HEADER = 2 * sizeof(uint32_t);
+
+  static void setHeader(std::string &blob, uint32_t count, uint32_t last) {
+    std::memcpy(&blob[0], &count, sizeof(count));
+    std::memcpy(&blob[sizeof(count)], &last, sizeof(last));
+  }
+
+public:
+  static uint32_t count(std::string_view blob) {
+    uint32_t n = 0;
+    if (blob.size() >= HEADER)
+      std::memcpy(&n, blob.data(), sizeof(n));
+    return n;
+  }
+
+  // the lowest doc, the first delta is taken from 0
+  static uint32_t first(std::string_view blob) {
+    uint64_t doc = 0;
+    if (blob.size() > HEADER) {
+      blob.remove_prefix(HEADER);
+      getVarint(blob, doc);
+    }
+    return static_cast<uint32_t>(doc);
+  }
+
+  static uint32_t last(std::string_view blob) {
+    uint32_t doc = 0;
+    if (blob.size() >= HEADER)
+      std::memcpy(&doc, blob.data() + sizeof(uint32_t), sizeof(doc));
+    return doc;
+  }
+
+  // appends the postings of blob to out, stops at the first damaged one
+  static void decodeInto(std::string_view blob, std::vector<Posting> &out) {
+    if (blob.size() < HEADER)
+      return;
+    if (out.empty())
+      out.reserve(count(blob));
+    blob.remove_prefix(HEADER);
+    uint64_t doc = 0, delta, tf;
+    while (!blob.empty() && getVarint(blob, delta) && getVarint(blob, tf)) {
+      doc += delta;
+      out.push_back({static_cast<uint32_t>(doc), static_cast<uint32_t>(tf)});
+    }
+  }
+
+  static std::vector<Posting> decode(std::string_view blob) {
+    std::vector<Posting> out;
+    decodeInto(blob, out);
+    return out;
+  }
+
+  static std::string encode(const std::vector<Posting> &postings) {
+    std::string blob(HEADER, '\0');
+    uint32_t prev = 0;
+    for (const auto &p : postings) {
+      putVarint(blob, p.doc - prev);
+      putVarint(blob, p.tf);
+      prev = p.doc;
+    }
+    setHeader(blob, static_cast<uint32_t>(postings.size()),
+              postings.empty() ? 0 : postings.back().doc);
+    return blob;
+  }
+
+  // adds p to blob, replacing the posting p.doc already had
+  static void add(std::string &blob, Posting p) {
+    uint32_t n = count(blob);
+    if (n == 0 || p.doc > last(blob)) {
+      if (blob.size() < HEADER)
+        blob.assign(HEADER, '\0');
+      putVarint(blob, n == 0 ? p.doc : p.doc - last(blob));
+      putVarint(blob, p.tf);
+      setHeader(blob, n + 1, p.doc);
+      return;
+    }
+    auto postings = decode(blob);
+    auto it = postings.begin();
+    while (it != postings.end() && it->doc < p.doc)
+      ++it;
+    if (it != postings.end() && it->doc == p.doc)
+      it->tf = p.tf;
+    else
+      postings.insert(it, p);
+    blob = encode(postings);
+  }
+
+  // drops the posting of doc, false if blob had none
+  static bool remove(std::string &blob, uint32_t doc) {
+    auto postings = decode(blob);
+    auto it = postings.begin();
+    while (it != postings.end() && it->doc < doc)
+      ++it;
+    if (it == postings.end() || it->doc != doc)
+      return false;
+    postings.erase(it);
+    blob = encode(postings);
+    return true;
+  }
+};
+
+} // namespace kv
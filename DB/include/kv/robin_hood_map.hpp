@@ -1,42 +1,126 @@
 #pragma once
 #include "hash_func.hpp"
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <fmt/core.h>
 #include <optional>
+#include <string>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 namespace kv {
 
+// key storage for string keys: up to INLINE bytes live in the entry itself,
+// longer keys get a heap block and keep its pointer in the same bytes
+class SmallString {
+  static constexpr size_t INLINE = 20;
+  static constexpr size_t PTR_AT = 4; // keeps the pointer 8-byte aligned
+  uint32_t len = 0;
+  char data[INLINE] = {};
+
+  char *heap() const {
+    char *p;
+    std::memcpy(&p, data + PTR_AT, sizeof(p));
+    return p;
+  }
+
+public:
+  SmallString() = default;
+  SmallString(std::string_view s) : len(static_cast<uint32_t>(s.size())) {
+    if (len <= INLINE) {
+      if (len)
+        std::memcpy(data, s.data(), len);
+      return;
+    }
+    char *p = new char[len];
+    std::memcpy(p, s.data(), len);
+    std::memcpy(data + PTR_AT, &p, sizeof(p));
+  }
+  SmallString(const SmallString &o) : SmallString(o.view()) {}
+  SmallString(SmallString &&o) noexcept : len(o.len) {
+    std::memcpy(data, o.data, INLINE);
+    o.len = 0;
+  }
+  SmallString &operator=(SmallString o) noexcept {
+    std::swap(len, o.len);
+    std::swap(data, o.data);
+    return *this;
+  }
+  ~SmallString() {
+    if (len > INLINE)
+      delete[] heap();
+  }
+
+  std::string_view view() const {
+    return {len > INLINE ? heap() : data, len};
+  }
+  operator std::string_view() const { return view(); }
+};
+
+// hash table for string-like keys, probed the swiss table way (the name is
+// from the robin hood table it started as). Control bytes sit apart from the
+// entries, one per slot: EMPTY, DELETED or 7 bits of the hash, and a probe
+// compares a whole group of 16 of them against the tag at once. Only slots
+// whose tag matches get their entry touched, where the full hash is compared
+// before the key bytes. Growing never hashes a key again. Lookups take a
+// std::string_view, or a view plus the hash when the caller already has it
+// (it must be HashFunc of the view)
 template <typename Key, typename Val,
-          uint64_t (*HashFunc)(std::string_view) = fnv1a>
+          uint64_t (*HashFunc)(std::string_view) = wyhash>
 class RobinHoodMap {
 public:
   RobinHoodMap(size_t default_map_size = 53);
   ~RobinHoodMap() = default;
 
-  bool put(const Key &key, const Val &val);
-  std::optional<Val> get(const Key &key) const;
-  bool erase(const Key &key);
+  bool put(std::string_view key, const Val &val);
+  bool put(std::string_view key, uint64_t hash, const Val &val);
+  std::optional<Val> get(std::string_view key) const;
+  std::optional<Val> get(std::string_view key, uint64_t hash) const;
+  bool erase(std::string_view key);
+  bool erase(std::string_view key, uint64_t hash);
+  void reserve(size_t count);
   size_t size() const noexcept { return _map_size; }
   void print_map() const;
   std::vector<std::pair<Key, Val>> get_all() const;
+  template <typename F> void for_each(F &&visit) const;
 
 private:
+  static constexpr size_t GROUP = 16; // control bytes per probe
+  static constexpr int8_t EMPTY = -128;
+  static constexpr int8_t DELETED = -2;
+
+  using _Stored =
+      std::conditional_t<std::is_same_v<Key, std::string>, SmallString, Key>;
+
   struct _MapEntry {
-    Key key;
-    Val val;
-    size_t probe_len = 0;
-    bool occupied = false;
+    uint64_t hash = 0;
+    _Stored key;
+    Val val{};
   };
 
-  std::vector<_MapEntry> _buckets;
+  std::vector<int8_t> _ctrl;         // EMPTY, DELETED or the tag
+  std::vector<_MapEntry> _entries;   // same slots as _ctrl
   size_t _map_size = 0;
-  void _rehash();
+  size_t _deleted = 0;               // DELETED control bytes
+  unsigned _shift = 63;              // 64 - log2(groups)
+  size_t _group_mask = 0;            // groups - 1
+  void _resize(size_t slots);
+  size_t _find(std::string_view key, uint64_t hash) const;
+  size_t _free_slot(uint64_t hash) const;
+  static uint32_t _match(const int8_t *group, int8_t tag);
+  static uint32_t _match_free(const int8_t *group);
 
-  size_t _ideal_hash(std::string_view key) const {
-    return (HashFunc(key) % _buckets.size());
+  // fibonacci hashing, the top bits of the product pick the first group
+  size_t _first_group(uint64_t hash) const {
+    return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> _shift);
+  }
+  // bits 7..13: the keydir picks its stripe by the low bits, so they are
+  // the same for every key of a table
+  static int8_t _tag(uint64_t hash) {
+    return static_cast<int8_t>((hash >> 7) & 0x7f);
   }
 };
 
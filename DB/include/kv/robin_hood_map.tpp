@@ -13,23 +13,25 @@
 #include <utility>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace kv {
 
 // ============================ UTILITY/HELPER FUNCTIONS =======================
-
-// another helper func to get the next prime number ahead of n
-inline size_t next_size(size_t n) {
-  if (n <= 2)
-    return 2;
-  return 2 * n + 1;
-}
+//
+// Probing goes group by group: the 16 control bytes of a group are compared
+// against the tag in one go, and an EMPTY byte in the group ends the search.
+// Groups are visited in triangular order, which reaches every group of a
+// power of two table. Erase leaves a DELETED byte so later probes keep going,
+// unless the group still has an EMPTY one (every probe stops there anyway);
+// a resize drops them all.
 
 // constructor to init the hash map
 template <typename K, typename V, uint64_t (*H)(std::string_view)>
 RobinHoodMap<K, V, H>::RobinHoodMap(size_t def_size) {
-  def_size = 26;
-  _buckets.assign(def_size, _MapEntry{});
-  _map_size = 0;
+  _resize(def_size);
 }
 
 // utility func to print the hash map
@@ -37,12 +39,11 @@ template <typename K, typename V, uint64_t (*H)(std::string_view)>
 void RobinHoodMap<K, V, H>::print_map() const {
   std::cout << "------------------------\nHash Map" << '\n';
   std::cout << "No of elements: " << _map_size
-            << " | Bucket size: " << _buckets.size() << '\n';
-  for (auto &x : _buckets) {
-    if (x.occupied) {
-      std::cout << fmt::format(std::to_string(x.key)) << ": "
-                << fmt::format(std::to_string(x.val))
-                << ", prob: " << x.probe_len << '\n';
+            << " | Slots: " << _ctrl.size() << '\n';
+  for (size_t i = 0; i < _ctrl.size(); ++i) {
+    if (_ctrl[i] >= 0) {
+      std::cout << std::string_view(_entries[i].key) << ": "
+                << fmt::format(std::to_string(_entries[i].val)) << '\n';
     } else {
       std::cout << "empty!" << '\n';
     }
@@ -54,125 +55,187 @@ void RobinHoodMap<K, V, H>::print_map() const {
 template <typename K, typename V, uint64_t (*H)(std::string_view)>
 std::vector<std::pair<K, V>> RobinHoodMap<K, V, H>::get_all() const {
   std::vector<std::pair<K, V>> items;
-  for (auto x : _buckets) {
-    if (x.occupied) {
-      items.push_back({x.key, x.val});
+  items.reserve(_map_size);
+  for_each([&](std::string_view key, const V &val) {
+    items.push_back({K(key), val});
+  });
+  return items;
+}
+
+// calls visit(key, val) on every element without copying them out, the key
+// comes as a std::string_view
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+template <typename F>
+void RobinHoodMap<K, V, H>::for_each(F &&visit) const {
+  for (size_t i = 0; i < _ctrl.size(); ++i) {
+    if (_ctrl[i] >= 0) {
+      visit(std::string_view(_entries[i].key), _entries[i].val);
     }
   }
-  return items;
 }
 
-// ============================ MAIN FUNCTIONS =================================
+// bit i set where control byte i of the group equals tag
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+uint32_t RobinHoodMap<K, V, H>::_match(const int8_t *group, int8_t tag) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+  return static_cast<uint32_t>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag))));
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < GROUP; ++i) {
+    mask |= uint32_t{group[i] == tag} << i;
+  }
+  return mask;
+#endif
+}
 
-// put function to insert Val into the hash map
-template <typename Key, typename Val, uint64_t (*Hashfunc)(std::string_view)>
-bool RobinHoodMap<Key, Val, Hashfunc>::put(const Key &key, const Val &val) {
-  // if load factor > 0.7 then rehash
-  if ((static_cast<double>(_map_size + 1) / _buckets.size()) > 0.7) {
-    // std::cout << "rehashig" << '\n';
-    _rehash();
+// EMPTY and DELETED are the only control bytes with the top bit set
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+uint32_t RobinHoodMap<K, V, H>::_match_free(const int8_t *group) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+  return static_cast<uint32_t>(_mm_movemask_epi8(ctrl));
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < GROUP; ++i) {
+    mask |= uint32_t{group[i] < 0} << i;
   }
+  return mask;
+#endif
+}
 
-  // the hash of the key
-  size_t ind = _ideal_hash(std::to_string(key));
-  size_t curr_probe_len = 0;
-  _MapEntry to_insert = _MapEntry{key, val, 0, true};
-
-  // iterate all the entries
-  while (true) {
-    _MapEntry &e = _buckets[ind];
-    if (e.key == key) {
-      // updating current key and value
-      e.val = val;
-      return true;
-    } else if (e.occupied == false) {
-      // we found the first empty entry
-      std::swap(e, to_insert);
-      // std::cout << "called" << '\n';
-      _map_size++; // inc the map size, now shall we
-      return true;
-    } else if (e.probe_len < curr_probe_len) {
-      // we found the entry which have probe len smaller than curr_probe_len
-      std::swap(e, to_insert);
-      std::swap(curr_probe_len, to_insert.probe_len);
+// slot holding key, _ctrl.size() when it is not there
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+size_t RobinHoodMap<K, V, H>::_find(std::string_view key,
+                                    uint64_t hash) const {
+  int8_t tag = _tag(hash);
+  size_t g = _first_group(hash);
+  for (size_t step = 1;; ++step) {
+    const int8_t *group = _ctrl.data() + g * GROUP;
+    for (uint32_t m = _match(group, tag); m; m &= m - 1) {
+      size_t i = g * GROUP + static_cast<size_t>(__builtin_ctz(m));
+      if (_entries[i].hash == hash && std::string_view(_entries[i].key) == key)
+        return i;
     }
-    ind = (ind + 1) % _buckets.size();
-    curr_probe_len++;
-    to_insert.probe_len = curr_probe_len;
+    if (_match(group, EMPTY))
+      return _ctrl.size();
+    g = (g + step) & _group_mask;
   }
-
-  return false;
 }
 
-// get function in the hash map
+// first EMPTY or DELETED slot on the probe path of hash
 template <typename K, typename V, uint64_t (*H)(std::string_view)>
-std::optional<V> RobinHoodMap<K, V, H>::get(const K &key) const {
-  size_t ind = _ideal_hash(std::to_string(key));
-  size_t curr_probe_dist = 0;
-
-  // iterating in the _buckets
-  while (true) {
-    const _MapEntry &curr = _buckets[ind];
-    if (curr.key == key) {
-      // found the key in the hash map
-      return curr.val;
-    } else if (curr.occupied == false || curr_probe_dist > curr.probe_len) {
-      // not found the key instead the first empty space
-      // or the curr prob distance greateer than the curr probe length
-      return std::nullopt;
-    }
-    ind = (ind + 1) % _buckets.size();
-    curr_probe_dist++;
+size_t RobinHoodMap<K, V, H>::_free_slot(uint64_t hash) const {
+  size_t g = _first_group(hash);
+  for (size_t step = 1;; ++step) {
+    if (uint32_t m = _match_free(_ctrl.data() + g * GROUP))
+      return g * GROUP + static_cast<size_t>(__builtin_ctz(m));
+    g = (g + step) & _group_mask;
   }
-  return std::nullopt;
 }
 
-// the function to delete a certain key from the hashmap
-// we will also implement backward shift deletion instead of tombstone
-template <typename K, typename V, uint64_t (*H)(std::string_view)>
-bool RobinHoodMap<K, V, H>::erase(const K &key) {
-  size_t ind = _ideal_hash(std::to_string(key));
-  size_t curr_probe_dist = 0;
-
-  while (true) {
-    _MapEntry &curr = _buckets[ind];
-    if (curr.key == key) {
-      // found the key in the hash map
-      break;
-    } else if (curr.occupied == false || curr_probe_dist > curr.probe_len) {
-      // not found the key instead the first empty space
-      // or the curr prob distance greateer than the curr probe length meaning
-      // theere is someone else
-      return false;
-    }
-    ind = (ind + 1) % _buckets.size();
-    curr_probe_dist++;
+// ============================ MAIN FUNCTIONS =================================
+
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+bool RobinHoodMap<K, V, H>::put(std::string_view key, const V &val) {
+  return put(key, H(key), val);
+}
+
+// put function to insert Val into the hash map
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+bool RobinHoodMap<K, V, H>::put(std::string_view key, uint64_t hash,
+                                const V &val) {
+  size_t found = _find(key, hash);
+  if (found != _ctrl.size()) {
+    // updating current key and value
+    _entries[found].val = val;
+    return true;
   }
+  // keep at least 1/8 of the slots EMPTY so every probe ends, grow unless
+  // most of the used slots are only DELETED ones
+  if ((_map_size + _deleted + 1) * 8 > _ctrl.size() * 7)
+    _resize(_deleted > _map_size / 2 ? _ctrl.size() : _ctrl.size() * 2);
+
+  size_t at = _free_slot(hash);
+  if (_ctrl[at] == DELETED)
+    --_deleted;
+  _ctrl[at] = _tag(hash);
+  _entries[at] = _MapEntry{hash, _Stored(key), val};
+  _map_size++;
+  return true;
+}
 
-  // backward shift deletion
-  size_t next = (ind + 1) % _buckets.size();
-  while (_buckets[next].occupied && _buckets[next].probe_len > 0) {
-    _buckets[ind] = _buckets[next];
-    --_buckets[ind].probe_len;
-    ind = next;
-    next = (next + 1) % _buckets.size();
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+std::optional<V> RobinHoodMap<K, V, H>::get(std::string_view key) const {
+  return get(key, H(key));
+}
+
+// get function in the hash map
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+std::optional<V> RobinHoodMap<K, V, H>::get(std::string_view key,
+                                            uint64_t hash) const {
+  size_t found = _find(key, hash);
+  if (found == _ctrl.size())
+    return std::nullopt;
+  return _entries[found].val;
+}
+
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+bool RobinHoodMap<K, V, H>::erase(std::string_view key) {
+  return erase(key, H(key));
+}
+
+// the function to delete a certain key from the hashmap
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+bool RobinHoodMap<K, V, H>::erase(std::string_view key, uint64_t hash) {
+  size_t at = _find(key, hash);
+  if (at == _ctrl.size())
+    return false;
+  if (_match(_ctrl.data() + at / GROUP * GROUP, EMPTY)) {
+    _ctrl[at] = EMPTY;
+  } else {
+    _ctrl[at] = DELETED;
+    ++_deleted;
   }
-  _buckets[ind] = _MapEntry{};
+  _entries[at] = _MapEntry{};
   --_map_size;
   return true;
 }
 
-// rehash function to rehash everything with new size
+// grows the table once so that count entries fit under the load factor,
+// saves the chain of resizes when the final size is known up front
 template <typename K, typename V, uint64_t (*H)(std::string_view)>
-void RobinHoodMap<K, V, H>::_rehash() {
-  size_t new_bucket_size = next_size((size_t)_buckets.size());
-  std::vector<_MapEntry> old_buckets = std::move(_buckets);
-  _buckets.assign(new_bucket_size, _MapEntry{});
-  _map_size = 0;
-  for (auto &x : old_buckets) {
-    if (x.occupied) {
-      put(x.key, x.val);
-    }
+void RobinHoodMap<K, V, H>::reserve(size_t count) {
+  size_t needed = count + count / 7 + 1;
+  if (needed > _ctrl.size())
+    _resize(needed);
+}
+
+// moves every entry into at least `slots` slots in one pass, no duplicate
+// checks and no DELETED bytes to skip over. The stored hashes mean no key is
+// hashed again
+template <typename K, typename V, uint64_t (*H)(std::string_view)>
+void RobinHoodMap<K, V, H>::_resize(size_t slots) {
+  size_t cap = 2 * GROUP; // two groups at least, keeps _shift below 64
+  unsigned shift = 63;
+  while (cap < slots) {
+    cap <<= 1;
+    --shift;
+  }
+  std::vector<int8_t> old_ctrl = std::move(_ctrl);
+  std::vector<_MapEntry> old_entries = std::move(_entries);
+  _ctrl.assign(cap, EMPTY);
+  _entries.assign(cap, _MapEntry{});
+  _shift = shift;
+  _group_mask = cap / GROUP - 1;
+  _deleted = 0;
+  for (size_t i = 0; i < old_ctrl.size(); ++i) {
+    if (old_ctrl[i] < 0)
+      continue;
+    size_t at = _free_slot(old_entries[i].hash);
+    _ctrl[at] = old_ctrl[i];
+    _entries[at] = std::move(old_entries[i]);
   }
 }
 
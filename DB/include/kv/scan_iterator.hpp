@@ -0,0 +1,25 @@
+#pragma once
+#include "segment_manager.hpp"
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace kv {
+
+// walks every live key of a model once, newest version only, as of the moment
+// it was created. Writes, erases and compactions after that do not change
+// what it yields. Values are read lazily in file order, so memory stays at one
+// small location per key plus a read block, whatever the size of the values
+class ScanIterator {
+  std::vector<ScanSnapshot> shards;
+  size_t shard = 0; // shard being walked
+  size_t pos = 0;   // next entry of its live list
+  size_t seg = 0;   // reader of the last entry's segment
+
+public:
+  explicit ScanIterator(std::vector<ScanSnapshot> shards);
+  // the next pair, the views stay valid until the following call
+  bool next(std::string_view &key, std::string_view &val);
+};
+
+} // namespace kv
@@ -1,21 +1,111 @@
 // include/kv/search_index.hpp
 #pragma once
+#include "posting_list.hpp"
 #include "storage_engine.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <map>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <set>
+#include <shared_mutex>
 #include <string>
-#include <unordered_set>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace kv {
 
+// how the terms of a query combine
+enum class Match {
+  All, // every term has to occur in the document
+  Any  // one is enough, more of them rank higher
+};
+
+struct SearchHit {
+  std::string docId;
+  double score; // BM25
+};
+
+// An inverted index kept in the same StorageEngine as the documents. Every
+// document gets a small integer ordinal, posting lists hold ordinals in the
+// binary PostingList format. All keys share index_prefix:
+//
+//   <prefix>t:<term>          newest postings of the term (the head)
+//   <prefix>t:<term>:<first>  older postings, BLOCK_POSTINGS per block
+//   <prefix>d:<docId>         ordinal of the document and the terms it
+//                             was indexed under, all varint prefixed
+//   <prefix>o:<ord>           length of the document (varint) and its docId
+//   <prefix>next              the next ordinal to hand out
+//
+// Indexing a document always hands out a fresh ordinal, so a posting only
+// ever lands at the end of the head and appending costs the same however
+// long the list is. When the head fills up it is frozen into a block keyed
+// by its first ordinal (zero padded, so key order is ordinal order). The
+// ordinal a document had before loses its o: entry, postings still pointing
+// at it are skipped by search.
+//
+// Removing or reindexing a document only retires its ordinal. Its terms come
+// from the d: record and are queued, purgeRetired() later rewrites just those
+// lists without the retired postings. Once PURGE_AFTER documents have been
+// retired, schedulePurge() queues that rewrite on a pool.
+//
+// The lengths of the live documents are also kept in memory, loaded from the
+// o: entries when the index is opened. Ranking only needs them and the
+// posting lists, docIds are looked up for the final top k.
 class SearchIndex {
 private:
+  static constexpr uint32_t BLOCK_POSTINGS = 1024;
+  static constexpr uint32_t RETIRED = std::numeric_limits<uint32_t>::max();
+  static constexpr size_t PURGE_AFTER = 1024; // retired docs per purge
+  // BM25 parameters, the usual defaults
+  static constexpr double K1 = 1.2;
+  static constexpr double B = 0.75;
+
+  // a document after tokenizing, before it has an ordinal
+  struct AnalyzedDoc {
+    std::string docId;
+    std::map<std::string, uint32_t> termCounts; // in term order
+    uint32_t len = 0;                            // terms in total
+  };
+
   StorageEngine &storage;
   std::string index_prefix;
+  mutable std::shared_mutex mu; // indexing exclusive, searches shared
+  uint32_t next_ord = 0;
+  std::vector<uint32_t> doc_lens; // by ordinal, RETIRED if not live
+  size_t live_docs = 0;
+  uint64_t total_len = 0; // summed over the live documents
+  std::set<std::string> purge_terms; // lists holding retired postings
+  bool purge_all = false; // not known after a restart, sweep every list
+  size_t retired = 0;     // documents retired since the last purge
+  std::mutex bg_mu;       // guards bg_purge
+  std::future<size_t> bg_purge; // the queued/running background purge
+
+  std::string termKey(const std::string &term) const {
+    return index_prefix + "t:" + term;
+  }
+  std::string blockKey(const std::string &term, uint32_t first) const {
+    std::string ord = std::to_string(first);
+    return termKey(term) + ":" + std::string(10 - ord.size(), '0') + ord;
+  }
+  std::string docKey(const std::string &docId) const {
+    return index_prefix + "d:" + docId;
+  }
+  std::string ordKey(uint32_t ord) const {
+    return index_prefix + "o:" + std::to_string(ord);
+  }
 
   // Helper function to tokenize text into words
-  std::vector<std::string> tokenize(const std::string &text) {
+  std::vector<std::string> tokenize(const std::string &text) const {
     std::vector<std::string> tokens;
     std::string token;
 
@@ -35,145 +125,492 @@ private:
     return tokens;
   }
 
-  // Add a document to a term's posting list
-  void addToTerm(const std::string &term, const std::string &docId) {
-    std::string termKey = index_prefix + term;
-    auto existing = storage.get(termKey);
+  // Tokenizes the string fields of a document and counts its terms
+  AnalyzedDoc analyze(const std::string &docId,
+                      const nlohmann::json &fields) const {
+    AnalyzedDoc doc;
+    doc.docId = docId;
 
-    nlohmann::json postings;
-    if (existing) {
-      postings = nlohmann::json::parse(*existing);
-    } else {
-      postings = nlohmann::json::array();
+    // Process each field
+    for (auto it = fields.begin(); it != fields.end(); ++it) {
+      if (it.value().is_string()) {
+        std::string text = it.value();
+        auto tokens = tokenize(text);
+
+        for (const auto &token : tokens) {
+          ++doc.termCounts[token];
+          ++doc.len;
+        }
+      }
     }
+    return doc;
+  }
 
-    // Check if docId is already in the postings
-    bool found = false;
-    for (const auto &id : postings) {
-      if (id == docId) {
-        found = true;
-        break;
+  // Rebuilds the in-memory state from the dictionary
+  void load() {
+    if (auto stored = storage.get(index_prefix + "next")) {
+      next_ord = static_cast<uint32_t>(std::stoul(*stored));
+    }
+    doc_lens.assign(next_ord, RETIRED);
+    std::string prefix = index_prefix + "o:";
+    for (const auto &[key, val] : storage.scan(prefix)) {
+      uint32_t ord =
+          static_cast<uint32_t>(std::stoul(key.substr(prefix.size())));
+      std::string_view in = val.value();
+      uint64_t len;
+      if (ord < next_ord && getVarint(in, len)) {
+        setLength(ord, static_cast<uint32_t>(len));
       }
     }
+    purge_all = live_docs < next_ord;
+  }
 
-    if (!found) {
-      postings.push_back(docId);
-      storage.put(termKey, postings.dump());
+  // Marks ord live with len terms, or retires it when len is RETIRED
+  void setLength(uint32_t ord, uint32_t len) {
+    if (ord >= doc_lens.size()) {
+      doc_lens.resize(ord + 1, RETIRED);
+    }
+    if (doc_lens[ord] != RETIRED) {
+      --live_docs;
+      total_len -= doc_lens[ord];
+    }
+    doc_lens[ord] = len;
+    if (len != RETIRED) {
+      ++live_docs;
+      total_len += len;
     }
   }
 
-public:
-  SearchIndex(StorageEngine &storage)
-      : storage(storage), index_prefix("search_index:") {}
+  // The ordinal in a d: record and, if terms is given, the terms in it
+  static std::optional<uint32_t> parseDocRecord(std::string_view in,
+                                                std::vector<std::string> *terms) {
+    uint64_t ord, count, len;
+    if (!getVarint(in, ord)) {
+      return std::nullopt;
+    }
+    if (terms && getVarint(in, count)) {
+      for (uint64_t i = 0; i < count && getVarint(in, len); i++) {
+        if (len > in.size()) {
+          break;
+        }
+        terms->emplace_back(in.substr(0, len));
+        in.remove_prefix(len);
+      }
+    }
+    return static_cast<uint32_t>(ord);
+  }
 
-  // Index a document with the given fields
-  void indexDocument(const std::string &docId, const nlohmann::json &fields) {
-    std::unordered_set<std::string> uniqueTerms;
+  // Retires the ordinal of a d: record and queues its lists for purging.
+  // Caller holds mu
+  bool retireRecord(std::string_view record) {
+    std::vector<std::string> terms;
+    auto ord = parseDocRecord(record, &terms);
+    if (!ord) {
+      return false;
+    }
+    storage.erase(ordKey(*ord));
+    setLength(*ord, RETIRED);
+    purge_terms.insert(terms.begin(), terms.end());
+    ++retired;
+    return true;
+  }
 
-    // Process each field
-    for (auto it = fields.begin(); it != fields.end(); ++it) {
-      if (it.value().is_string()) {
-        std::string text = it.value();
-        auto tokens = tokenize(text);
+  // Same for docId, false if it was not indexed. Caller holds mu
+  bool retire(const std::string &docId) {
+    auto record = storage.get_view(docKey(docId));
+    return record && retireRecord(record->value());
+  }
 
-        for (const auto &token : tokens) {
-          uniqueTerms.insert(token);
+  // Hands doc a new ordinal, queuing its dictionary entries on ops. The one
+  // it had is retired by the caller, who holds mu
+  uint32_t newOrdinal(const AnalyzedDoc &doc,
+                      std::vector<std::pair<std::string, std::string>> &ops) {
+    uint32_t ord = next_ord++;
+    setLength(ord, doc.len);
+    std::string record;
+    putVarint(record, ord);
+    putVarint(record, doc.termCounts.size());
+    for (const auto &[term, tf] : doc.termCounts) {
+      putVarint(record, term.size());
+      record += term;
+    }
+    ops.emplace_back(docKey(doc.docId), std::move(record));
+    std::string entry;
+    putVarint(entry, doc.len);
+    entry += doc.docId;
+    ops.emplace_back(ordKey(ord), std::move(entry));
+    return ord;
+  }
+
+  // Adds analyzed documents as one write batch: their d: records and the
+  // heads of all their terms are read with one multi_get each, the postings
+  // of every term are appended in memory and each touched list is written
+  // once. A docId that comes more than once keeps its last version. Caller
+  // holds mu
+  void addDocuments(const std::vector<AnalyzedDoc> &docs) {
+    std::unordered_map<std::string_view, size_t> lastOf;
+    for (size_t i = 0; i < docs.size(); i++) {
+      lastOf[docs[i].docId] = i;
+    }
+    std::vector<const AnalyzedDoc *> kept;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < docs.size(); i++) {
+      if (lastOf[docs[i].docId] == i) {
+        kept.push_back(&docs[i]);
+        keys.push_back(docKey(docs[i].docId));
+      }
+    }
+    for (const auto &record : storage.multi_get(keys)) {
+      if (record) {
+        retireRecord(record->value());
+      }
+    }
+
+    std::vector<std::pair<std::string, std::string>> ops;
+    std::map<std::string, std::vector<Posting>> added; // ordinals ascend
+    for (const auto *doc : kept) {
+      uint32_t ord = newOrdinal(*doc, ops);
+      for (const auto &[term, tf] : doc->termCounts) {
+        added[term].push_back({ord, tf});
+      }
+    }
+    ops.emplace_back(index_prefix + "next", std::to_string(next_ord));
+
+    keys.clear();
+    for (const auto &[term, postings] : added) {
+      keys.push_back(termKey(term));
+    }
+    auto heads = storage.multi_get(keys);
+    size_t i = 0;
+    for (const auto &[term, postings] : added) {
+      std::string blob = heads[i] ? heads[i]->str() : std::string();
+      for (const auto &p : postings) {
+        PostingList::add(blob, p);
+        if (PostingList::count(blob) >= BLOCK_POSTINGS) {
+          ops.emplace_back(blockKey(term, PostingList::first(blob)),
+                           std::move(blob));
+          blob = PostingList::encode({});
         }
       }
+      ops.emplace_back(std::move(keys[i]), std::move(blob));
+      ++i;
     }
+    storage.write_batch(ops);
+  }
 
-    // Add document to each term's posting list
-    for (const auto &term : uniqueTerms) {
-      addToTerm(term, docId);
+  // Rewrites one stored list without its retired postings, false if it
+  // had none. Caller holds mu
+  bool purgeList(const std::string &key, std::string_view blob) {
+    auto postings = PostingList::decode(blob);
+    auto keep = std::remove_if(
+        postings.begin(), postings.end(), [&](const Posting &p) {
+          return p.doc >= doc_lens.size() || doc_lens[p.doc] == RETIRED;
+        });
+    if (keep == postings.end()) {
+      return false;
     }
+    postings.erase(keep, postings.end());
+    if (postings.empty()) {
+      storage.erase(key);
+    } else {
+      storage.put(key, PostingList::encode(postings));
+    }
+    return true;
   }
 
-  // Search for documents matching all terms
-  std::vector<std::string> search(const std::string &query) {
-    auto queryTokens = tokenize(query);
+  // Every live posting of term in ordinal order, the frozen blocks and then
+  // the head. A doc that is not above the last one is skipped, a reader can
+  // briefly see a head that was just frozen in both places
+  std::vector<Posting> postingsOf(const std::string &term) const {
+    std::vector<Posting> postings;
+    auto append = [&](std::string_view blob) {
+      size_t from = postings.size();
+      uint32_t floor = from > 0 ? postings[from - 1].doc : 0;
+      PostingList::decodeInto(blob, postings);
+      auto keep = std::remove_if(
+          postings.begin() + from, postings.end(), [&](const Posting &p) {
+            return (from > 0 && p.doc <= floor) || p.doc >= doc_lens.size() ||
+                   doc_lens[p.doc] == RETIRED;
+          });
+      postings.erase(keep, postings.end());
+    };
+    for (const auto &[key, blob] : storage.scan(termKey(term) + ":")) {
+      append(blob.value());
+    }
+    if (auto head = storage.get_view(termKey(term))) {
+      append(head->value());
+    }
+    return postings;
+  }
 
-    if (queryTokens.empty()) {
-      return {};
+  // First position at or after from whose doc is not below doc: doubling
+  // steps to bracket it, then a binary search inside the bracket. Cheap when
+  // a long list is probed with the few docs of a short one
+  static size_t gallop(const std::vector<Posting> &list, size_t from,
+                       uint32_t doc) {
+    size_t step = 1, hi = from;
+    while (hi < list.size() && list[hi].doc < doc) {
+      from = hi + 1;
+      hi += step;
+      step *= 2;
     }
+    hi = std::min(hi, list.size());
+    return std::lower_bound(
+               list.begin() + from, list.begin() + hi, doc,
+               [](const Posting &p, uint32_t d) { return p.doc < d; }) -
+           list.begin();
+  }
 
-    // Get posting list for first term
-    std::string firstTermKey = index_prefix + queryTokens[0];
-    auto firstPosting = storage.get(firstTermKey);
+  // The BM25 weight of a term occurring tf times in a document of len terms
+  static double termScore(double idf, uint32_t tf, uint32_t len,
+                          double avg_len) {
+    double norm = K1 * (1 - B + B * len / avg_len);
+    return idf * tf * (K1 + 1) / (tf + norm);
+  }
 
-    if (!firstPosting) {
-      return {};
+public:
+  SearchIndex(StorageEngine &storage)
+      : storage(storage), index_prefix("search_index:") {
+    load();
+  }
+
+  // a queued purge still points at this index
+  ~SearchIndex() {
+    std::lock_guard lock(bg_mu);
+    if (bg_purge.valid())
+      bg_purge.wait();
+  }
+
+  // false until something has been indexed, models nobody searches never
+  // get index keys
+  bool indexed() const {
+    std::shared_lock lock(mu);
+    return next_ord > 0;
+  }
+
+  // Index a document with the given fields
+  void indexDocument(const std::string &docId, const nlohmann::json &fields) {
+    std::vector<AnalyzedDoc> docs{analyze(docId, fields)};
+    std::unique_lock lock(mu);
+    addDocuments(docs);
+  }
+
+  // Indexes many documents at once: they are tokenized in parallel on pool,
+  // then added as a single write batch, so every touched posting list is
+  // read and written once per call instead of once per document. Returns
+  // how many documents were indexed
+  size_t indexBatch(const std::vector<std::pair<std::string, nlohmann::json>> &batch,
+                    ThreadPool &pool) {
+    static constexpr size_t CHUNK = 256; // documents per tokenizing task
+    std::vector<std::future<std::vector<AnalyzedDoc>>> parts;
+    for (size_t from = 0; from < batch.size(); from += CHUNK) {
+      size_t to = std::min(batch.size(), from + CHUNK);
+      parts.push_back(pool.submit([this, &batch, from, to] {
+        std::vector<AnalyzedDoc> docs;
+        docs.reserve(to - from);
+        for (size_t i = from; i < to; i++) {
+          docs.push_back(analyze(batch[i].first, batch[i].second));
+        }
+        return docs;
+      }));
+    }
+    std::vector<AnalyzedDoc> docs;
+    docs.reserve(batch.size());
+    for (auto &part : parts) {
+      for (auto &doc : part.get()) {
+        docs.push_back(std::move(doc));
+      }
     }
 
-    std::unordered_set<std::string> resultSet;
-    nlohmann::json firstDocs = nlohmann::json::parse(*firstPosting);
+    std::unique_lock lock(mu);
+    addDocuments(docs);
+    return docs.size();
+  }
 
-    for (const auto &docId : firstDocs) {
-      resultSet.insert(docId);
+  // Drops the whole index, every key under the prefix included
+  void clear() {
+    std::unique_lock lock(mu);
+    for (const auto &[key, val] : storage.scan(index_prefix)) {
+      storage.erase(key);
     }
+    next_ord = 0;
+    doc_lens.clear();
+    live_docs = 0;
+    total_len = 0;
+    purge_terms.clear();
+    purge_all = false;
+    retired = 0;
+  }
 
-    // Intersect with other terms
-    for (size_t i = 1; i < queryTokens.size(); i++) {
-      std::string termKey = index_prefix + queryTokens[i];
-      auto posting = storage.get(termKey);
+  // The k best documents for text by BM25, best first (k = 0 for all). For
+  // Match::All the shortest posting list drives and the longer ones are
+  // galloped through, so the cost follows the rarest term
+  std::vector<SearchHit> query(const std::string &text, size_t k = 10,
+                               Match match = Match::All) const {
+    auto queryTokens = tokenize(text);
+    std::sort(queryTokens.begin(), queryTokens.end());
+    queryTokens.erase(std::unique(queryTokens.begin(), queryTokens.end()),
+                      queryTokens.end());
 
-      if (!posting) {
+    if (queryTokens.empty()) {
+      return {};
+    }
+
+    std::shared_lock lock(mu);
+    std::vector<std::vector<Posting>> lists;
+    for (const auto &term : queryTokens) {
+      auto postings = postingsOf(term);
+      if (postings.empty() && match == Match::All) {
         return {}; // No documents match this term
       }
+      lists.push_back(std::move(postings));
+    }
+    std::sort(lists.begin(), lists.end(),
+              [](const auto &a, const auto &b) { return a.size() < b.size(); });
+
+    double n = static_cast<double>(live_docs);
+    double avg_len = live_docs ? double(total_len) / live_docs : 1.0;
+    avg_len = std::max(avg_len, 1.0);
+    std::vector<double> idf;
+    for (const auto &list : lists) {
+      double df = static_cast<double>(list.size());
+      idf.push_back(std::log(1 + (n - df + 0.5) / (df + 0.5)));
+    }
 
-      nlohmann::json docs = nlohmann::json::parse(*posting);
-      std::unordered_set<std::string> termDocs;
-
-      for (const auto &docId : docs) {
-        termDocs.insert(docId);
+    // ordinal and score of every match, in ordinal order
+    std::vector<std::pair<uint32_t, double>> scored;
+    std::vector<size_t> pos(lists.size(), 0);
+    if (match == Match::All) {
+      for (const auto &p : lists[0]) {
+        double score = termScore(idf[0], p.tf, doc_lens[p.doc], avg_len);
+        bool all = true;
+        for (size_t t = 1; t < lists.size() && all; t++) {
+          pos[t] = gallop(lists[t], pos[t], p.doc);
+          all = pos[t] < lists[t].size() && lists[t][pos[t]].doc == p.doc;
+          if (all) {
+            score += termScore(idf[t], lists[t][pos[t]].tf, doc_lens[p.doc],
+                               avg_len);
+          }
+        }
+        if (all) {
+          scored.emplace_back(p.doc, score);
+        }
       }
-
-      // Keep only documents that are in both sets
-      std::unordered_set<std::string> intersection;
-      for (const auto &docId : resultSet) {
-        if (termDocs.find(docId) != termDocs.end()) {
-          intersection.insert(docId);
+    } else {
+      // merge the lists, a doc's score sums over the lists it is on
+      while (true) {
+        uint32_t doc = RETIRED;
+        for (size_t t = 0; t < lists.size(); t++) {
+          if (pos[t] < lists[t].size()) {
+            doc = std::min(doc, lists[t][pos[t]].doc);
+          }
+        }
+        if (doc == RETIRED) {
+          break;
         }
+        double score = 0;
+        for (size_t t = 0; t < lists.size(); t++) {
+          if (pos[t] < lists[t].size() && lists[t][pos[t]].doc == doc) {
+            score += termScore(idf[t], lists[t][pos[t]].tf, doc_lens[doc],
+                               avg_len);
+            ++pos[t];
+          }
+        }
+        scored.emplace_back(doc, score);
       }
+    }
+    lock.unlock();
+
+    // best first, ties by ordinal so results are stable
+    auto better = [](const auto &a, const auto &b) {
+      return a.second != b.second ? a.second > b.second : a.first < b.first;
+    };
+    if (k > 0 && scored.size() > k) {
+      std::partial_sort(scored.begin(), scored.begin() + k, scored.end(),
+                        better);
+      scored.resize(k);
+    } else {
+      std::sort(scored.begin(), scored.end(), better);
+    }
 
-      resultSet = std::move(intersection);
-
-      if (resultSet.empty()) {
-        return {}; // No documents match all terms
+    // Map the ordinals back to docIds
+    std::vector<std::string> keys;
+    keys.reserve(scored.size());
+    for (const auto &[ord, score] : scored) {
+      keys.push_back(ordKey(ord));
+    }
+    auto entries = storage.multi_get(keys);
+    std::vector<SearchHit> hits;
+    for (size_t i = 0; i < scored.size(); i++) {
+      if (!entries[i]) {
+        continue; // retired since the lock was dropped
+      }
+      std::string_view in = entries[i]->value();
+      uint64_t len;
+      if (getVarint(in, len)) {
+        hits.push_back({std::string(in), scored[i].second});
       }
     }
+    return hits;
+  }
 
-    // Convert set to vector for return
-    return std::vector<std::string>(resultSet.begin(), resultSet.end());
+  // Search for documents matching all terms, best match first
+  std::vector<std::string> search(const std::string &query) const {
+    std::vector<std::string> docIds;
+    for (auto &hit : this->query(query, 0, Match::All)) {
+      docIds.push_back(std::move(hit.docId));
+    }
+    return docIds;
   }
 
-  // Remove a document from the index
+  // Remove a document from the index. Only its ordinal is retired here, the
+  // postings go with the next purgeRetired()
   void removeDocument(const std::string &docId) {
-    // Find all terms that reference this document
-    auto all_keys = storage.get_all();
-
-    for (const auto &pair : all_keys) {
-      if (pair.first.find(index_prefix) == 0) {
-        nlohmann::json postings = nlohmann::json::parse(pair.second);
-        nlohmann::json newPostings = nlohmann::json::array();
-        bool changed = false;
-
-        for (const auto &id : postings) {
-          if (id != docId) {
-            newPostings.push_back(id);
-          } else {
-            changed = true;
-          }
-        }
+    std::unique_lock lock(mu);
+    if (retire(docId)) {
+      storage.erase(docKey(docId));
+    }
+  }
 
-        if (changed) {
-          if (newPostings.empty()) {
-            storage.erase(pair.first);
-          } else {
-            storage.put(pair.first, newPostings.dump());
-          }
+  // Drops the postings of retired ordinals from the lists that have them,
+  // returns how many lists were rewritten. Search already skips them, so
+  // this only reclaims space and is meant to run off the request path
+  size_t purgeRetired() {
+    std::unique_lock lock(mu);
+    size_t rewritten = 0;
+    if (purge_all) {
+      for (const auto &[key, blob] : storage.scan(index_prefix + "t:")) {
+        rewritten += purgeList(key, blob.value());
+      }
+      purge_all = false;
+    } else {
+      for (const auto &term : purge_terms) {
+        for (const auto &[key, blob] : storage.scan(termKey(term) + ":")) {
+          rewritten += purgeList(key, blob.value());
+        }
+        if (auto head = storage.get_view(termKey(term))) {
+          rewritten += purgeList(termKey(term), head->value());
         }
       }
     }
+    purge_terms.clear();
+    retired = 0;
+    return rewritten;
+  }
+
+  // Queues purgeRetired() on pool once PURGE_AFTER documents wait for it,
+  // unless a purge is already pending
+  void schedulePurge(ThreadPool &pool) {
+    {
+      std::shared_lock lock(mu);
+      if (retired < PURGE_AFTER)
+        return;
+    }
+    std::lock_guard lock(bg_mu);
+    if (bg_purge.valid() &&
+        bg_purge.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return;
+    bg_purge = pool.submit([this] { return purgeRetired(); });
   }
 };
 
@@ -1,10 +1,18 @@
 #pragma once
 #include "bloomfilter.hpp"
-#include "robin_hood_map.hpp"
+#include "compressor.hpp"
+#include "hash_func.hpp"
+#include "value_view.hpp"
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
-#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 namespace kv {
 
@@ -13,11 +21,29 @@ struct SegmentOffset {
   size_t offset;
 };
 
+// one record of a segment as the keydir sees it. The .idx snapshot is a list
+// of these in append order followed by their keys back to back
+struct IndexEntry {
+  uint64_t hash;
+  uint64_t offset;
+  uint32_t size; // whole record, length prefix included
+  uint32_t key_len : 31;
+  uint32_t tombstone : 1; // the record erases its key
+};
+
+using IndexVisitor =
+    std::function<void(const IndexEntry &, std::string_view key)>;
+
+// RecordHeader::flags bits
+constexpr uint8_t RECORD_LIVE = 1;   // unset for a tombstone
+constexpr uint8_t RECORD_CRC32C = 2; // the crc is CRC32C, records written
+                                     // before it carry IEEE CRC-32
+
 struct RecordHeader {
   uint32_t key_len;
   uint32_t val_len;
-  uint8_t flags;
-  uint8_t reserved;
+  uint8_t flags; // RECORD_* bits
+  uint8_t codec; // a Codec, how the value is stored
   uint32_t record_len;
 };
 
@@ -30,23 +56,121 @@ struct RecordFooter {
   char *padding;
 };
 
+// where the time went while a segment was opened at startup
+struct RecoveryTimes {
+  double index_ms = 0; // reading the .idx snapshot
+  double bloom_ms = 0; // reading or rebuilding the bloom filter
+  double scan_ms = 0;  // reindexing records past the snapshot
+  size_t scanned = 0;  // bytes covered by that scan
+};
+
+// callback used while walking a segment file record by record, gets the
+// record offset, its header, key, value and whether the stored crc matched
+using RecordVisitor =
+    std::function<void(size_t, const RecordHeader &, std::string_view,
+                       std::string_view, bool)>;
+
+// a read-only hold on a segment that stays usable after the Segment object
+// and its file are gone: it shares the mapping of a sealed segment, or has a
+// descriptor of its own on the active one. Records are handed out of large
+// blocks, so reading them in file order touches the disk sequentially, and
+// compressed values come back decompressed
+class SegmentReader {
+  static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+  size_t id;
+  std::shared_ptr<const char> map;
+  size_t map_len = 0;
+  int fd = -1;
+  std::string block; // pread buffer when there is no mapping
+  size_t block_off = 0;
+  std::shared_ptr<const Compressor> compressor;
+  std::string unpacked; // the last value that had to be decompressed
+
+public:
+  SegmentReader(size_t id, std::shared_ptr<const char> map, size_t map_len,
+                int fd, std::shared_ptr<const Compressor> compressor);
+  SegmentReader(SegmentReader &&o) noexcept;
+  SegmentReader &operator=(SegmentReader &&o) noexcept;
+  SegmentReader(const SegmentReader &) = delete;
+  SegmentReader &operator=(const SegmentReader &) = delete;
+  ~SegmentReader();
+
+  size_t getId() const { return id; }
+  // the record of size bytes at offset, false if it is torn, fails its crc,
+  // does not decompress or is a tombstone. The views stay valid until the
+  // next call
+  bool record(size_t offset, size_t size, std::string_view &key,
+              std::string_view &val);
+};
+
 class Segment {
   size_t id;
   std::string seg_file_path, ind_file_path, bf_file_path;
-  RobinHoodMap<uint64_t, size_t> local_ind;
-  std::fstream data;
+  std::vector<IndexEntry> entries; // records of this file, kept while it is
+                                   // active and until recovery is done
+  std::string entry_keys;          // their keys, back to back
+  BloomSizing bloom_sizing;
   BloomFilter bf;
+  std::atomic<size_t> file_size{0};  // bytes written in the .kv file, read
+                                     // by point reads next to the writer
+  std::atomic<size_t> dead_bytes{0}; // bytes of overwritten/erased records
+  bool persist = true;               // save .idx/.bf when closing
+  bool snapshot_fresh = false;       // .idx/.bf on disk match the file
+  RecoveryTimes times;
+  int fd = -1;                       // O_APPEND handle, also used by pread
+  const char *map = nullptr;         // whole file, mapped once sealed
+  size_t map_len = 0;
+  std::shared_ptr<const char> mapping; // owns map, views of it share it
+  std::shared_ptr<const Compressor> compressor; // decodes stored values
+  HashFn hash_fn; // the model's, for records reindexed from the file
 
 public:
-  Segment(size_t id, const std::string &dir, size_t segsize);
+  Segment(size_t id, const std::string &dir, const BloomSizing &bloom,
+          HashFn hash,
+          std::shared_ptr<const Compressor> compressor,
+          const std::string &suffix = "");
   ~Segment();
   size_t appendRecord(uint64_t hash, std::string_view key,
-                      std::string_view val);
-  void loadBloom();
+                      std::string_view val, bool tombstone = false,
+                      Codec codec = Codec::Raw);
+  static size_t encodeRecord(std::string &buf, std::string_view key,
+                             std::string_view val, bool tombstone = false,
+                             Codec codec = Codec::Raw);
+  void writeRaw(const char *buf, size_t len);
+  void index(uint64_t hash, std::string_view key, size_t offset, size_t size,
+             bool tombstone = false);
+  void sync();
+  bool truncate(size_t end);
+  bool loadBloom(size_t covered);
   void saveBloom();
-  void loadIndex();
+  BloomFilter buildBloom(size_t keys) const;
+  void setBloom(BloomFilter filter) { bf = std::move(filter); }
+  size_t loadIndex();
   void saveIndex();
-  bool lookup(uint64_t hash, SegmentOffset &out);
+  void recover();
+  bool mayContain(uint64_t hash) const { return bf.maybeContains(hash); }
+  void seal();
+  std::optional<ValueView> read(size_t offset, std::string_view key,
+                                bool verify = true) const;
+  size_t scan(const RecordVisitor &visit, size_t from = 0) const;
+  SegmentReader reader() const;
+  size_t recordSize(size_t offset) const;
+
+  size_t getId() const { return id; }
+  const RecoveryTimes &recoveryTimes() const { return times; }
+  bool sealed() const { return map != nullptr; }
+  size_t bytes() const { return file_size; }
+  size_t keyCount() const { return entries.size(); }
+  void visitIndex(const IndexVisitor &visit) const;
+  void pruneIndex(
+      const std::function<bool(const IndexEntry &, std::string_view)> &live);
+  void releaseIndex();
+  size_t deadBytes() const { return dead_bytes; }
+  void addDead(size_t n) { dead_bytes += n; }
+  void setDead(size_t n) { dead_bytes = n; }
+  // drop the segment without rewriting its .idx/.bf on close
+  void discard() { persist = false; }
 };
 
 } // namespace kv
@@ -1,26 +1,251 @@
 #pragma once
+#include "config.hpp"
+#include "hash_func.hpp"
+#include "ordered_index.hpp"
+#include "robin_hood_map.hpp"
 #include "segment.hpp"
+#include "thread_pool.hpp"
+#include "value_cache.hpp"
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 namespace kv {
 
+// where the newest version of a key lives
+struct KeyDirEntry {
+  uint64_t offset;
+  uint32_t segment_id;
+  uint32_t size; // whole record, length prefix included
+  // same record, the size follows from that
+  bool operator==(const KeyDirEntry &o) const {
+    return offset == o.offset && segment_id == o.segment_id;
+  }
+};
+
+// the keydir: key -> newest record, across every segment of the set. Keys
+// are kept in full so two keys sharing a hash never shadow each other.
+//
+// It is split into stripes by the low bits of the hash, each with its own
+// lock, so a point read only ever waits for a writer publishing into the
+// same stripe and readers on different stripes never share a lock word.
+// Changes are made under mu and ind_mu with the stripe lock (or all of them)
+// held exclusively, a read holds any one of those three. A write group holds
+// the stripes of all of its keys while it publishes, so a point read sees all
+// of it or none of it
+class KeyDir {
+  static constexpr size_t STRIPES = 64;
+
+  struct Stripe {
+    mutable std::shared_mutex mu;
+    RobinHoodMap<std::string, KeyDirEntry> map;
+  };
+  std::array<Stripe, STRIPES> stripes;
+
+  Stripe &stripeFor(uint64_t hash) { return stripes[hash % STRIPES]; }
+  const Stripe &stripeFor(uint64_t hash) const {
+    return stripes[hash % STRIPES];
+  }
+
+public:
+  std::optional<KeyDirEntry> get(std::string_view key, uint64_t hash) const {
+    return stripeFor(hash).map.get(key, hash);
+  }
+  void put(std::string_view key, uint64_t hash, const KeyDirEntry &at) {
+    stripeFor(hash).map.put(key, hash, at);
+  }
+  bool erase(std::string_view key, uint64_t hash) {
+    return stripeFor(hash).map.erase(key, hash);
+  }
+  void reserve(size_t count) {
+    for (auto &s : stripes)
+      s.map.reserve(count / STRIPES + 1);
+  }
+  size_t size() const {
+    size_t n = 0;
+    for (const auto &s : stripes)
+      n += s.map.size();
+    return n;
+  }
+  template <typename F> void for_each(F &&visit) const {
+    for (const auto &s : stripes)
+      s.map.for_each(visit);
+  }
+  // the lock of the stripe holding hash
+  std::shared_mutex &stripeLock(uint64_t hash) const {
+    return stripeFor(hash).mu;
+  }
+  // the stripes of every hash exclusively, in ascending order like lockAll,
+  // for a group of changes point reads must see at once
+  std::vector<std::unique_lock<std::shared_mutex>>
+  lockStripes(const std::vector<uint64_t> &hashes) {
+    std::array<bool, STRIPES> wanted{};
+    for (uint64_t h : hashes)
+      wanted[h % STRIPES] = true;
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    for (size_t i = 0; i < STRIPES; i++) {
+      if (wanted[i])
+        locks.emplace_back(stripes[i].mu);
+    }
+    return locks;
+  }
+  // every stripe exclusively, for changes point reads must see at once
+  std::vector<std::unique_lock<std::shared_mutex>> lockAll() {
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    locks.reserve(STRIPES);
+    for (auto &s : stripes)
+      locks.emplace_back(s.mu);
+    return locks;
+  }
+};
+
+// the segments a point read can be sent to, ascending ids with the active one
+// last. It is never changed, a new list replaces it whole when a segment is
+// added or dropped, and a reader holding the old one keeps its segments alive
+struct SegmentList {
+  std::vector<std::shared_ptr<Segment>> segments;
+  std::shared_ptr<Segment> byId(size_t id) const;
+};
+
+// a keydir entry a merge rewrote, applied at install only if the key still
+// points where it did when the record was copied
+struct Relocation {
+  std::string key;
+  uint64_t hash;
+  KeyDirEntry from;
+  std::optional<KeyDirEntry> to; // nullopt when the merge dropped the record
+};
+
+// what a compaction run works on: a snapshot of the closed segments and which
+// of them get merged
+struct CompactionPlan {
+  std::vector<Segment *> snapshot; // closed segments, oldest first
+  std::vector<size_t> victims;     // indices into snapshot, ascending
+  std::vector<Relocation> moved;   // filled by the merge
+  size_t out_id = 0;               // id the merged segment takes over
+  bool empty() const { return victims.empty(); }
+};
+
+// what opening the existing segments cost at startup, the phase times are
+// summed over all segments while wall_ms is the elapsed time
+struct StartupReport {
+  size_t segments = 0;
+  size_t bytes = 0;   // .kv bytes found on disk
+  size_t scanned = 0; // bytes that had to be reindexed
+  double index_ms = 0, bloom_ms = 0, scan_ms = 0;
+  double wall_ms = 0;
+};
+
+// one queued put waiting for the group commit that carries it
+struct WriteReq {
+  WriteReq(uint64_t hash, std::string_view key, std::string_view val)
+      : hash(hash), key(key), val(val) {}
+
+  uint64_t hash;
+  std::string_view key, val;
+  size_t offset = 0;
+  size_t size = 0;
+  Codec codec = Codec::Raw; // how val is compressed
+  bool tombstone = false; // erases key, val is ignored
+  bool group_end = true; // last record of a write batch, the file may only
+                         // rotate and the index only publish after it
+  bool existed = false;  // set by the leader, the key had a live value
+  bool written = false;  // set by the leader once the record is indexed
+  bool done = false;    // set under q_mu, the waiter may return
+  std::exception_ptr error;
+};
+
+// what a scan of one segment set walks: the newest record of every key as of
+// the moment it was taken, by segment and then offset, and readers on the
+// segments holding them
+struct ScanSnapshot {
+  std::vector<SegmentReader> segments; // ascending ids
+  std::vector<KeyDirEntry> live;
+};
+
+// one key of a multi-get, out stays empty if it is missing
+struct ReadReq {
+  uint64_t hash;
+  std::string_view key;
+  std::optional<ValueView> out;
+};
+
 class SegmentMgr {
-  std::vector<Segment *> closed;
-  Segment *current;
-  std::mutex mu;
+  std::vector<std::shared_ptr<Segment>> closed;
+  std::shared_ptr<Segment> current;
+  // closed and current as point reads see them, swapped under ind_mu and
+  // every keydir stripe, loaded with std::atomic_load
+  std::shared_ptr<const SegmentList> published;
+  std::mutex mu; // serializes file writes and compaction installs
+  std::shared_mutex &ind_mu; // owned by the engine, scans hold it shared
+  ThreadPool &pool;          // owned by the engine too
+  ValueCache &cache;         // same, dropped from as writes are published
+  std::shared_ptr<const Compressor> compressor; // the model's, for segments
   size_t max_size;
+  BloomSizing bloom;
   std::string dir;
   size_t next_id = 1;
+  double dead_ratio;
+  Durability durability;
+  HashFn hash_fn; // the model's, for keys read back from segments
+  bool verify_reads; // point reads check the crc, scans always do
+  std::atomic<bool> compaction_due{false};
+  KeyDir keydir; // see KeyDir for the locking
+  bool keep_order;     // whether ordered is maintained
+  OrderedIndex ordered; // the keydir's keys in order, same locking
+
+  // group commit: puts queue up, whoever finds no leader writes the batch
+  std::mutex q_mu;
+  std::condition_variable q_cv;
+  std::deque<WriteReq *> queue;
+  bool leader_active = false;
+  std::string batch_buf;
+
+  StartupReport startup;
+
+  void recover();
+  Segment *segmentById(size_t id) const;
+  void buildKeyDir();
+  void publishSegments();
+  void markOverwritten(const KeyDirEntry &prev);
+  void submit(WriteReq *reqs, size_t n);
+  void commit(std::vector<WriteReq *> &batch);
+  void flushPending(std::vector<WriteReq *> &pending);
+  void rotate();
 
 public:
-  SegmentMgr(const std::string &dir, size_t segment_size);
-  ~SegmentMgr();
-  size_t append(uint64_t hash, std::string_view key, std::string_view val);
-  bool lookup(uint64_t hash, SegmentOffset &out);
+  SegmentMgr(const std::string &dir, const Config &conf,
+             std::shared_mutex &ind_mu, ThreadPool &pool, ValueCache &cache,
+             std::shared_ptr<const Compressor> compressor);
+  size_t append(uint64_t hash, std::string_view key, std::string_view val,
+                Codec codec = Codec::Raw);
+  void appendBatch(std::vector<WriteReq> &reqs);
+  bool remove(uint64_t hash, std::string_view key);
+  std::optional<ValueView> read(uint64_t hash, std::string_view key);
+  void readMany(std::vector<ReadReq> &reqs);
+  ScanSnapshot snapshot();
+  void range(std::string_view start, std::string_view end, size_t limit,
+             std::vector<std::pair<std::string, ValueView>> &out);
+  const StartupReport &startupReport() const { return startup; }
+
+  // compaction, see segment_mgr.cpp for the locking each step expects
+  bool compactionDue() const { return compaction_due; }
+  CompactionPlan planCompaction();
+  bool mergeSegments(CompactionPlan &plan);
+  bool installCompaction(CompactionPlan &plan);
+  void abortCompaction(CompactionPlan &plan);
 };
 
 } // namespace kv
@@ -1,25 +1,96 @@
 #pragma once
+#include "compressor.hpp"
+#include "config.hpp"
+#include "scan_iterator.hpp"
 #include "segment_manager.hpp"
+#include "thread_pool.hpp"
+#include "value_cache.hpp"
 #include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 namespace kv {
 
 class StorageEngine {
-  SegmentMgr seg_mgr;
+  // one slice of the key space with its own segments, active file, index
+  // lock and compaction state, so writers on different shards never meet
+  struct Shard {
+    std::string dir;
+    mutable std::shared_mutex ind_mu; // scans and multi-gets shared,
+                                      // index updates exclusive, point
+                                      // reads never take it
+    SegmentMgr seg_mgr;
+    std::mutex compact_mu;           // one compaction at a time
+    std::mutex bg_mu;                // guards bg_compaction
+    std::future<void> bg_compaction; // the queued/running background run
+
+    Shard(const std::string &dir, const Config &conf, ThreadPool &pool,
+          ValueCache &cache, std::shared_ptr<const Compressor> compressor)
+        : dir(dir), seg_mgr(dir, conf, ind_mu, pool, cache,
+                            std::move(compressor)) {}
+  };
+
+  std::unique_ptr<ThreadPool> own_pool; // only when none is passed in
+  ThreadPool &pool; // startup and background work (compaction)
   std::string dir; // where the files are at
-  std::shared_mutex ind_mu;
+  ValueCache cache; // hot values, shared by all shards
+  std::shared_ptr<Compressor> compressor; // values on their way to disk
+  HashFn hash_fn; // the model's key hash, fixed when it was created
+  std::vector<std::unique_ptr<Shard>> shards;
+
+  size_t shardIndex(uint64_t hash) const;
+  Shard &shardFor(uint64_t hash) const { return *shards[shardIndex(hash)]; }
+  bool compact(Shard &shard);
+  void scheduleCompaction(Shard &shard);
+  StorageEngine(const std::string &dir, const Config &conf,
+                ThreadPool *shared);
 
 public:
   StorageEngine(const std::string &dir, size_t seg_size);
+  // with a pool of its own, conf.thread_pool_sz threads
+  StorageEngine(const std::string &dir, const Config &conf);
+  // with work going to pool, which has to outlive the engine. A server
+  // with many models shares one pool instead of a pool per model
+  StorageEngine(const std::string &dir, const Config &conf, ThreadPool &pool);
+  ~StorageEngine();
   void put(const std::string &key, const std::string &val);
   std::optional<std::string> get(const std::string &key);
+  // the value without copying it, pinned by the view rather than the locks
+  std::optional<ValueView> get_view(const std::string &key);
+  // hands the value to fn while it is pinned, returns false if the key is
+  // missing
+  bool get_view(const std::string &key,
+                const std::function<void(std::string_view)> &fn);
   bool erase(const std::string &key);
-  std::vector<std::pair<std::string, std::string>> get_all() const;
+  // the values of keys in the same order, empty where a key is missing
+  std::vector<std::optional<ValueView>>
+  multi_get(const std::vector<std::string> &keys);
+  // puts every pair, all of a shard's pairs become visible at once
+  void write_batch(const std::vector<std::pair<std::string, std::string>> &ops);
+  // the live pairs whose key starts with prefix, in key order, at most limit
+  // of them (0 for all)
+  std::vector<std::pair<std::string, ValueView>>
+  scan(const std::string &prefix, size_t limit = 0);
+  // the same for keys in [start, end), an empty end runs to the last key
+  std::vector<std::pair<std::string, ValueView>>
+  range(const std::string &start, const std::string &end, size_t limit = 0);
+  // the end of the range holding the keys that start with prefix, empty if
+  // they run to the last key
+  static std::string prefixEnd(const std::string &prefix);
+  // every live key with its newest value, read lazily from a snapshot
+  ScanIterator get_all() const;
+  // merges closed segments over the dead ratio, returns true if it swapped
+  // anything in
+  bool compact();
+  CacheStats cacheStats() { return cache.stats(); }
 };
 
 } // namespace kv
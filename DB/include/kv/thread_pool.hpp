@@ -1,9 +1,12 @@
 #pragma once
 #include <condition_variable>
 #include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 namespace kv {
@@ -19,6 +22,15 @@ public:
   ThreadPool(size_t threads);
   ~ThreadPool();
   void enqueue(std::function<void()> job);
+
+  // same as enqueue, but hands back a future so the caller can wait on it
+  template <typename F> auto submit(F &&job) {
+    using R = std::invoke_result_t<F>;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(job));
+    std::future<R> fut = task->get_future();
+    enqueue([task] { (*task)(); });
+    return fut;
+  }
 };
 
 } // namespace kv
@@ -0,0 +1,84 @@
+#pragma once
+#include "value_view.hpp"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace kv {
+
+struct CacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+  size_t rejected = 0; // values the admission filter kept out
+  size_t entries = 0;
+  size_t bytes = 0;
+};
+
+// a bounded value cache in front of StorageEngine::get. Eviction is CLOCK
+// (a reference bit per slot and a sweeping hand), admission is TinyLFU: a
+// small count-min sketch remembers how often keys were asked for, and a new
+// value only pushes out the clock victim if it is asked for more often. That
+// keeps one-off scans from flushing the hot set.
+//
+// Coherence: every invalidate bumps the shard epoch, readers take the epoch
+// before going to disk and fill() drops their value if it moved since.
+class ValueCache {
+  static constexpr size_t SHARDS = 16;
+  static constexpr size_t SKETCH_ROWS = 4;
+  static constexpr size_t ENTRY_OVERHEAD = 64; // rough per-entry bookkeeping
+
+  struct Slot {
+    std::string key;
+    std::shared_ptr<const std::string> val; // shared with the views handed out
+    uint64_t hash = 0;
+    bool referenced = false;
+    bool occupied = false;
+  };
+
+  struct Shard {
+    std::mutex mu;
+    uint64_t epoch = 0;
+    std::unordered_map<std::string_view, size_t> index; // key -> slot
+    std::deque<Slot> slots; // a deque so the index views stay valid
+    std::vector<size_t> free_slots;
+    size_t hand = 0;
+    size_t bytes = 0;
+    std::vector<uint8_t> sketch; // SKETCH_ROWS rows of counters up to 15
+    size_t sketch_adds = 0;
+  };
+
+  size_t capacity;       // bytes, for the whole cache
+  size_t shard_capacity; // bytes, per shard
+  size_t sketch_width;   // counters per row, a power of two
+  std::array<Shard, SHARDS> shards;
+  std::atomic<size_t> hits{0}, misses{0}, evictions{0}, rejected{0};
+
+  Shard &shardFor(uint64_t hash) { return shards[(hash >> 56) % SHARDS]; }
+  size_t sketchIndex(uint64_t hash, size_t row) const;
+  void touch(Shard &s, uint64_t hash);
+  uint8_t frequency(const Shard &s, uint64_t hash) const;
+  void removeSlot(Shard &s, size_t slot);
+
+public:
+  ValueCache(size_t capacity_bytes);
+  bool enabled() const { return capacity > 0; }
+
+  std::optional<ValueView> get(uint64_t hash, std::string_view key);
+  uint64_t epoch(uint64_t hash);
+  void fill(uint64_t hash, std::string_view key, std::string_view val,
+            uint64_t seen_epoch);
+  void invalidate(uint64_t hash, std::string_view key);
+  CacheStats stats();
+};
+
+} // namespace kv
@@ -0,0 +1,25 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace kv {
+
+// a value handed out without copying it. The bytes stay valid for as long as
+// the view or a copy of it is alive, since it shares ownership of whatever
+// holds them: a segment's mapping, a cached value or a read buffer
+class ValueView {
+  std::shared_ptr<const void> owner;
+  std::string_view val;
+
+public:
+  ValueView() = default;
+  ValueView(std::shared_ptr<const void> owner, std::string_view val)
+      : owner(std::move(owner)), val(val) {}
+
+  std::string_view value() const { return val; }
+  std::string str() const { return std::string(val); }
+};
+
+} // namespace kv
@@ -1,32 +1,115 @@
 #include "../include/kv/bloomfilter.hpp"
+#include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define KV_BLOOM_AVX2 1
+#endif
+
 namespace kv {
 
-BloomFilter::BloomFilter(std::size_t bitsize, size_t numhashes)
-    : bits(bitsize), m(bitsize), k(numhashes) {}
+// odd multipliers, one per word, that spread the low half of the hash over
+// the 32 bit positions of each word
+alignas(32) static const uint32_t SALT[BloomFilter::WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+// false positive rate of a block filter holding on average `load` keys per
+// block: block loads are poisson distributed and a probe into a block with j
+// keys hits when all eight of its bits are already set
+static double blockFpRate(double load) {
+  double fp = 0, pois = std::exp(-load);
+  size_t last = static_cast<size_t>(load * 4) + 64;
+  for (size_t j = 0; j <= last; ++j) {
+    if (j > 0)
+      pois *= load / j;
+    double bit = 1 - std::pow(31.0 / 32.0, static_cast<double>(j));
+    fp += pois * std::pow(bit, static_cast<double>(BloomFilter::WORDS));
+  }
+  return fp;
+}
+
+// keys per block that keep the filter at fp_rate, found by bisection since
+// blockFpRate only grows with the load
+static double blockLoadFor(double fp_rate) {
+  double lo = 0.01, hi = 256;
+  for (int i = 0; i < 48; ++i) {
+    double mid = (lo + hi) / 2;
+    if (blockFpRate(mid) <= fp_rate)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+BloomFilter::BloomFilter(std::size_t bitsize, size_t capacity)
+    : blocks(std::max<size_t>((bitsize + BLOCK_BITS - 1) / BLOCK_BITS, 1)),
+      cap(capacity) {}
+
+BloomFilter BloomFilter::forKeys(size_t keys, const BloomSizing &sizing) {
+  double load = blockLoadFor(std::clamp(sizing.fp_rate, 1e-9, 0.5));
+  size_t n = static_cast<size_t>(std::ceil(keys / load));
+  n = std::max(n, (sizing.min_bits + BLOCK_BITS - 1) / BLOCK_BITS);
+  n = std::max<size_t>(n, 1);
+  return BloomFilter(n * BLOCK_BITS, static_cast<size_t>(n * load));
+}
+
+// bit position of the key in each word of its block
+static inline void bitsFor(uint32_t key, uint32_t out[BloomFilter::WORDS]) {
+  for (size_t i = 0; i < BloomFilter::WORDS; ++i) {
+    out[i] = uint32_t{1} << ((key * SALT[i]) >> 27);
+  }
+}
 
 void BloomFilter::add(uint64_t hash) {
-  // double‑hashing: split into two 32‑bit halves
-  uint64_t h1 = hash;
-  uint64_t h2 = (hash >> 32) | (hash << 32);
-  for (size_t i = 0; i < k; ++i) {
-    size_t idx = (h1 + i * h2) % m;
-    bits[idx] = true;
+  hash = mix(hash);
+  uint32_t mask[WORDS];
+  bitsFor(static_cast<uint32_t>(hash), mask);
+  Block &b = blocks[blockFor(hash)];
+  for (size_t i = 0; i < WORDS; ++i) {
+    b.w[i] |= mask[i];
   }
 }
 
-bool BloomFilter::maybeContains(uint64_t hash) const {
-  uint64_t h1 = hash;
-  uint64_t h2 = (hash >> 32) | (hash << 32);
-  // created two redundant hash functions to hash the key in k different way
-  for (size_t i = 0; i < k; ++i) {
-    size_t idx = (h1 + i * h2) % m;
-    if (!bits[idx])
+static bool probeScalar(const uint32_t *block, uint32_t key) {
+  uint32_t mask[BloomFilter::WORDS];
+  bitsFor(key, mask);
+  for (size_t i = 0; i < BloomFilter::WORDS; ++i) {
+    if ((block[i] & mask[i]) != mask[i])
       return false;
   }
   return true;
 }
 
+#ifdef KV_BLOOM_AVX2
+// the eight words of a block are one ymm register, the whole probe is a
+// multiply, a shift, a variable shift and one testc
+__attribute__((target("avx2"))) static bool probeAvx2(const uint32_t *block,
+                                                      uint32_t key) {
+  __m256i salt = _mm256_load_si256(reinterpret_cast<const __m256i *>(SALT));
+  __m256i pos = _mm256_srli_epi32(
+      _mm256_mullo_epi32(_mm256_set1_epi32(static_cast<int>(key)), salt), 27);
+  __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), pos);
+  __m256i bits = _mm256_load_si256(reinterpret_cast<const __m256i *>(block));
+  return _mm256_testc_si256(bits, mask);
+}
+
+static const bool HAS_AVX2 = __builtin_cpu_supports("avx2");
+#endif
+
+bool BloomFilter::maybeContains(uint64_t hash) const {
+  hash = mix(hash);
+  const uint32_t *block = blocks[blockFor(hash)].w;
+  uint32_t key = static_cast<uint32_t>(hash);
+#ifdef KV_BLOOM_AVX2
+  if (HAS_AVX2)
+    return probeAvx2(block, key);
+#endif
+  return probeScalar(block, key);
+}
+
 } // namespace kv
@@ -0,0 +1,179 @@
+#include "../include/kv/compressor.hpp"
+#include "../include/kv/utils.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <lz4.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
+#include <zstd.h>
+
+namespace kv {
+
+// compression contexts are not thread safe, every thread keeps its own
+static ZSTD_CCtx *compressContext() {
+  thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> ctx(
+      ZSTD_createCCtx(), ZSTD_freeCCtx);
+  return ctx.get();
+}
+
+static ZSTD_DCtx *decompressContext() {
+  thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx(
+      ZSTD_createDCtx(), ZSTD_freeDCtx);
+  return ctx.get();
+}
+
+Compressor::Dictionary::Dictionary(std::string content)
+    : bytes(std::move(content)) {
+  cdict = ZSTD_createCDict(bytes.data(), bytes.size(), ZSTD_CLEVEL_DEFAULT);
+  ddict = ZSTD_createDDict(bytes.data(), bytes.size());
+}
+
+Compressor::Dictionary::~Dictionary() {
+  ZSTD_freeCDict(cdict);
+  ZSTD_freeDDict(ddict);
+}
+
+// picks up the dictionary of an earlier run whatever the mode, values
+// compressed with it have to stay readable
+Compressor::Compressor(const std::string &dir, const Config &conf)
+    : mode(conf.compression), dict_path(dir + "/DICT"),
+      dict_size(conf.compression_dict_kb * 1024) {
+  std::ifstream in(dict_path, std::ios::binary);
+  if (!in)
+    return;
+  std::string bytes((std::istreambuf_iterator<char>(in)),
+                    std::istreambuf_iterator<char>());
+  if (!bytes.empty())
+    dict = std::make_shared<const Dictionary>(std::move(bytes));
+}
+
+// adds the start of val to the dictionary being collected, and saves it once
+// it is full. The file and the rename into place (through the directory) are
+// synced before anything can be compressed against it, a record must never
+// point at a dictionary a crash could lose
+void Compressor::sample(std::string_view val) {
+  std::lock_guard lock(sample_mu);
+  size_t want = dict_size.load(std::memory_order_relaxed);
+  if (std::atomic_load(&dict) || want == 0)
+    return;
+  samples.append(val.substr(0, std::min(val.size(), SAMPLE_BYTES)));
+  if (samples.size() < want)
+    return;
+  samples.resize(want);
+
+  std::string tmp = dict_path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0;
+  for (size_t done = 0; ok && done < samples.size();) {
+    ssize_t n = ::write(fd, samples.data() + done, samples.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    ok = n > 0;
+    done += ok ? static_cast<size_t>(n) : 0;
+  }
+  ok = ok && ::fdatasync(fd) == 0;
+  if (fd >= 0)
+    ::close(fd);
+  std::error_code ec;
+  if (ok)
+    std::filesystem::rename(tmp, dict_path, ec);
+  ok = ok && !ec &&
+       utils::syncDir(std::filesystem::path(dict_path).parent_path());
+  if (!ok) {
+    // keep using plain zstd frames rather than a dictionary we cannot keep
+    std::cerr << "warning: could not save " << dict_path << '\n';
+    std::filesystem::remove(tmp, ec);
+    dict_size.store(0, std::memory_order_relaxed);
+    std::string().swap(samples);
+    return;
+  }
+  std::atomic_store(&dict, std::shared_ptr<const Dictionary>(
+                               std::make_shared<Dictionary>(
+                                   std::move(samples))));
+  std::string().swap(samples);
+}
+
+Codec Compressor::compress(std::string_view val, std::string &out) {
+  if (mode == Compression::None || val.size() < MIN_BYTES)
+    return Codec::Raw;
+
+  if (mode == Compression::LZ4) {
+    uint32_t len = static_cast<uint32_t>(val.size());
+    out.resize(sizeof(len) + LZ4_compressBound(static_cast<int>(len)));
+    std::memcpy(out.data(), &len, sizeof(len));
+    int n = LZ4_compress_default(val.data(), out.data() + sizeof(len),
+                                 static_cast<int>(len),
+                                 static_cast<int>(out.size() - sizeof(len)));
+    if (n <= 0 || sizeof(len) + n >= val.size())
+      return Codec::Raw;
+    out.resize(sizeof(len) + n);
+    return Codec::LZ4;
+  }
+
+  auto d = std::atomic_load(&dict);
+  if (!d && dict_size.load(std::memory_order_relaxed) > 0)
+    sample(val);
+  out.resize(ZSTD_compressBound(val.size()));
+  size_t n = d ? ZSTD_compress_usingCDict(compressContext(), out.data(),
+                                          out.size(), val.data(), val.size(),
+                                          d->cdict)
+               : ZSTD_compressCCtx(compressContext(), out.data(), out.size(),
+                                   val.data(), val.size(),
+                                   ZSTD_CLEVEL_DEFAULT);
+  if (ZSTD_isError(n) || n >= val.size())
+    return Codec::Raw;
+  out.resize(n);
+  return d ? Codec::ZstdDict : Codec::Zstd;
+}
+
+bool Compressor::decompress(Codec codec, std::string_view stored,
+                            std::string &out) const {
+  switch (codec) {
+  case Codec::Raw:
+    out.assign(stored);
+    return true;
+  case Codec::LZ4: {
+    uint32_t len;
+    if (stored.size() < sizeof(len))
+      return false;
+    std::memcpy(&len, stored.data(), sizeof(len));
+    out.resize(len);
+    int n = LZ4_decompress_safe(stored.data() + sizeof(len), out.data(),
+                                static_cast<int>(stored.size() - sizeof(len)),
+                                static_cast<int>(len));
+    return n >= 0 && static_cast<uint32_t>(n) == len;
+  }
+  case Codec::Zstd:
+  case Codec::ZstdDict: {
+    unsigned long long len =
+        ZSTD_getFrameContentSize(stored.data(), stored.size());
+    if (len == ZSTD_CONTENTSIZE_UNKNOWN || len == ZSTD_CONTENTSIZE_ERROR)
+      return false;
+    std::shared_ptr<const Dictionary> d;
+    if (codec == Codec::ZstdDict && !(d = std::atomic_load(&dict)))
+      return false;
+    out.resize(len);
+    size_t n = d ? ZSTD_decompress_usingDDict(decompressContext(), out.data(),
+                                              out.size(), stored.data(),
+                                              stored.size(), d->ddict)
+                 : ZSTD_decompressDCtx(decompressContext(), out.data(),
+                                       out.size(), stored.data(),
+                                       stored.size());
+    return !ZSTD_isError(n) && n == len;
+  }
+  }
+  return false;
+}
+
+} // namespace kv
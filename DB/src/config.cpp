@@ -33,8 +33,51 @@ Config Config::load(std::string conf_path) {
   c.index_ext = j.value("index_extension", ".idx");
   c.bloom_ext = j.value("bloom_extension", ".bf");
   c.bloom_bits_kb = j.value("bloom_bits_kb", 8);
-  c.bloom_hashes = j.value("bloom_hashes", 4);
+  c.bloom_fp_rate = j.value("bloom_fp_rate", 0.01);
   c.thread_pool_sz = j.value("thread_pool_size", 4);
+  c.compaction_dead_ratio = j.value("compaction_dead_ratio", 0.5);
+  c.shards = j.value("shards", 1);
+  c.cache_size_mb = j.value("cache_size_mb", 32);
+  c.ordered_index = j.value("ordered_index", true);
+  c.compression_dict_kb = j.value("compression_dict_kb", 16);
+  c.verify_reads = j.value("verify_reads", true);
+
+  std::string durability = j.value("durability", "flush");
+  if (durability == "none") {
+    c.durability = Durability::None;
+  } else if (durability == "fdatasync") {
+    c.durability = Durability::Sync;
+  } else if (durability == "flush") {
+    c.durability = Durability::Flush;
+  } else {
+    std::cerr << "Error: unknown durability '" << durability
+              << "', expected none, flush or fdatasync\n";
+    std::exit(EXIT_FAILURE);
+  }
+
+  std::string compression = j.value("compression", "none");
+  if (compression == "none") {
+    c.compression = Compression::None;
+  } else if (compression == "lz4") {
+    c.compression = Compression::LZ4;
+  } else if (compression == "zstd") {
+    c.compression = Compression::Zstd;
+  } else {
+    std::cerr << "Error: unknown compression '" << compression
+              << "', expected none, lz4 or zstd\n";
+    std::exit(EXIT_FAILURE);
+  }
+
+  std::string hash = j.value("hash", "wyhash");
+  if (hash == "fnv1a") {
+    c.hash = HashAlgo::Fnv1a;
+  } else if (hash == "wyhash") {
+    c.hash = HashAlgo::WyHash;
+  } else {
+    std::cerr << "Error: unknown hash '" << hash
+              << "', expected fnv1a or wyhash\n";
+    std::exit(EXIT_FAILURE);
+  }
 
   std::cout << "the config is loaded with the data directory as: " << c.data_dir
             << '\n';
@@ -114,11 +114,12 @@ int main(int argc, char *argv[]) {
   //     std::cout << "not found" << '\n';
   //   }
   // }
-  auto all = engine.get_all(); // it returns a vector
+  auto all = engine.get_all(); // it returns an iterator
 
   std::cout << "these are all of the things stored in the db" << '\n';
-  for (auto x : all) {
-    std::cout << x.first << ": " << x.second << '\n';
+  std::string_view key, val;
+  while (all.next(key, val)) {
+    std::cout << key << ": " << val << '\n';
   }
 
   return 0;
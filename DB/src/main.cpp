@@ -1,10 +1,20 @@
 #include "../include/kv/config.hpp"         // Your database Config class
+#include "../include/kv/search_index.hpp"   // Full text index over a model
 #include "../include/kv/storage_engine.hpp" // Your database StorageEngine class
+#include "../include/kv/thread_pool.hpp"
 #include <cctype>
 #include <crow.h>
 #include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -18,6 +28,131 @@ std::string to_lower(std::string data) {
   return data;
 }
 
+// a JSON string of s, bytes that are not UTF-8 (binary values such as the
+// search index postings) are replaced instead of failing the whole response
+std::string json_string(std::string_view s) {
+  return nlohmann::json(std::string(s))
+      .dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+// appends "key":value to a JSON object being written by hand. Values are
+// stored as dumped JSON, anything else goes out as a string
+void append_json_pair(std::string &out, std::string_view key,
+                      std::string_view val) {
+  out += json_string(key);
+  out += ':';
+  if (nlohmann::json::accept(val.begin(), val.end()))
+    out += val;
+  else
+    out += json_string(val);
+}
+
+// the search index keeps its records in the model next to the documents,
+// all of them in [INDEX_PREFIX, INDEX_END) of the key order
+static constexpr std::string_view INDEX_PREFIX = "search_index:";
+static constexpr std::string_view INDEX_END = "search_index;";
+
+bool is_index_key(std::string_view key) {
+  return key.substr(0, INDEX_PREFIX.size()) == INDEX_PREFIX;
+}
+
+// engine.range() without the index records: the part of [start, end) below
+// them, then the part above them while limit leaves room
+std::vector<std::pair<std::string, kv::ValueView>>
+document_range(kv::StorageEngine &engine, const std::string &start,
+               const std::string &end, size_t limit) {
+  std::vector<std::pair<std::string, kv::ValueView>> out;
+  std::string below =
+      end.empty() || end > INDEX_PREFIX ? std::string(INDEX_PREFIX) : end;
+  if (start < below)
+    out = engine.range(start, below, limit);
+  std::string above = std::max(start, std::string(INDEX_END));
+  if ((end.empty() || above < end) && (limit == 0 || out.size() < limit)) {
+    for (auto &pair : engine.range(above, end, limit ? limit - out.size() : 0))
+      out.push_back(std::move(pair));
+  }
+  return out;
+}
+
+// the limit query parameter, 0 (no limit) when it is missing
+size_t limit_param(const crow::request &req) {
+  auto limit = req.url_params.get("limit");
+  return limit ? std::stoul(limit) : 0;
+}
+
+// a JSON object of pairs already in key order
+crow::response
+pairs_response(const std::vector<std::pair<std::string, kv::ValueView>> &pairs) {
+  crow::response res;
+  res.body = "{";
+  for (size_t i = 0; i < pairs.size(); i++) {
+    if (i > 0)
+      res.body += ',';
+    append_json_pair(res.body, pairs[i].first, pairs[i].second.value());
+  }
+  res.body += '}';
+  return res;
+}
+
+// Objects kept per model (engines, search indexes), opened on first use.
+// The lock is only held to find or claim a model's slot: the open itself runs
+// outside it, and whoever asks for the same model meanwhile waits on the
+// slot's future, so one slow recovery holds up that model alone. Callers get
+// shared_ptr copies, a model taken out of the map lives on until its last
+// request is done with it
+template <typename T> class ModelMap {
+  struct Slot {
+    std::shared_future<std::shared_ptr<T>> ready;
+  };
+  std::mutex mu;
+  std::unordered_map<std::string, std::shared_ptr<Slot>> slots;
+
+public:
+  // the object of model, from open() if it is not there yet. An exception
+  // from open() reaches every waiting caller and leaves nothing behind
+  template <typename F>
+  std::shared_ptr<T> get(const std::string &model, F &&open) {
+    std::unique_lock lock(mu);
+    if (auto it = slots.find(model); it != slots.end()) {
+      auto slot = it->second;
+      lock.unlock();
+      return slot->ready.get();
+    }
+    std::promise<std::shared_ptr<T>> opening;
+    auto slot = std::make_shared<Slot>(Slot{opening.get_future().share()});
+    slots.emplace(model, slot);
+    lock.unlock();
+    try {
+      opening.set_value(open());
+    } catch (...) {
+      opening.set_exception(std::current_exception());
+      lock.lock();
+      auto it = slots.find(model);
+      if (it != slots.end() && it->second == slot)
+        slots.erase(it);
+    }
+    return slot->ready.get();
+  }
+
+  // removes model, handing back its object (nullptr if it was not open)
+  std::shared_ptr<T> take(const std::string &model) {
+    std::shared_ptr<Slot> slot;
+    {
+      std::lock_guard lock(mu);
+      auto it = slots.find(model);
+      if (it == slots.end())
+        return nullptr;
+      slot = std::move(it->second);
+      slots.erase(it);
+    }
+    try {
+      return slot->ready.get();
+    } catch (...) {
+      return nullptr; // never opened
+    }
+  }
+};
+
 int main() {
   // Load configuration
   kv::Config config;
@@ -39,28 +174,78 @@ int main() {
 
   crow::SimpleApp app;
 
-  // Map to hold StorageEngine instances for each model
-  std::unordered_map<std::string, std::unique_ptr<kv::StorageEngine>>
-      model_engines;
+  // One pool for every model: segment loading, compactions, tokenizing
+  // documents and index purges. Declared first so it outlives the engines
+  // and indexes that queue work on it
+  kv::ThreadPool pool(std::max<size_t>(1, config.thread_pool_sz));
+
+  // StorageEngine instances for each model. Requests run on several
+  // threads, see ModelMap
+  ModelMap<kv::StorageEngine> model_engines;
 
   // Function to get or create StorageEngine for a model
-  auto get_engine = [&config, &model_engines](
-                        const std::string &model) -> kv::StorageEngine * {
-    auto it = model_engines.find(model);
-    if (it != model_engines.end()) {
-      return it->second.get();
-    }
+  auto get_engine = [&config, &pool, &model_engines](const std::string &model)
+      -> std::shared_ptr<kv::StorageEngine> {
     std::string model_dir = config.data_dir + "/" + model;
     if (!fs::exists(model_dir)) {
       return nullptr;
     }
-    auto engine =
-        std::make_unique<kv::StorageEngine>(model_dir, config.segment_size);
-    auto *ptr = engine.get();
-    model_engines[model] = std::move(engine);
-    return ptr;
+    return model_engines.get(model, [&] {
+      return std::make_shared<kv::StorageEngine>(model_dir, config, pool);
+    });
   };
 
+  // Search indexes by model, each one stored in its model's own engine
+  ModelMap<kv::SearchIndex> model_indexes;
+
+  // Function to get or create the SearchIndex of a model. The index keeps
+  // its engine alive, it writes through a plain reference to it
+  auto get_index = [&get_engine, &model_indexes](const std::string &model)
+      -> std::shared_ptr<kv::SearchIndex> {
+    auto engine = get_engine(model);
+    if (!engine) {
+      return nullptr;
+    }
+    return model_indexes.get(model, [&] {
+      return std::shared_ptr<kv::SearchIndex>(
+          new kv::SearchIndex(*engine),
+          [engine](kv::SearchIndex *index) { delete index; });
+    });
+  };
+
+  // Keeps the search index of a model in step with its writes once it has
+  // one: JSON objects are (re)indexed, keys deleted (null value) or set to
+  // anything else drop out. The last write of a key wins. Retired documents
+  // pile up in the posting lists until the queued purge removes them
+  auto update_index =
+      [&get_index, &pool](
+          const std::string &model,
+          const std::vector<std::pair<std::string, const nlohmann::json *>>
+              &writes) {
+        auto index = get_index(model);
+        if (!index || !index->indexed()) {
+          return;
+        }
+        std::map<std::string_view, const nlohmann::json *> last;
+        for (const auto &[key, value] : writes) {
+          if (!is_index_key(key)) {
+            last[key] = value;
+          }
+        }
+        std::vector<std::pair<std::string, nlohmann::json>> docs;
+        for (const auto &[key, value] : last) {
+          if (value && value->is_object()) {
+            docs.emplace_back(std::string(key), *value);
+          } else {
+            index->removeDocument(std::string(key));
+          }
+        }
+        if (!docs.empty()) {
+          index->indexBatch(docs, pool);
+        }
+        index->schedulePurge(pool);
+      };
+
   // GET / - List all models
   CROW_ROUTE(app, "/").methods("GET"_method)(
       [&config](const crow::request &req) {
@@ -76,7 +261,7 @@ int main() {
 
   // POST /{model} - Create model and add data if provided
   CROW_ROUTE(app, "/<string>")
-      .methods("POST"_method)([&config, &model_engines, &get_engine](
+      .methods("POST"_method)([&config, &get_engine, &update_index](
                                   const crow::request &req, std::string model) {
         std::string model_dir = config.data_dir + "/" + model;
         std::cout << model_dir << "-> this is the model dir" << '\n';
@@ -90,9 +275,14 @@ int main() {
         if (!req.body.empty()) {
           try {
             auto json = nlohmann::json::parse(req.body);
+            std::vector<std::pair<std::string, std::string>> ops;
+            std::vector<std::pair<std::string, const nlohmann::json *>> writes;
             for (const auto &[key, value] : json.items()) {
-              engine->put(key, value.dump());
+              ops.emplace_back(key, value.dump());
+              writes.emplace_back(key, &value);
             }
+            engine->write_batch(ops);
+            update_index(model, writes);
           } catch (const std::exception &e) {
             return crow::response(400, "Invalid JSON");
           }
@@ -108,42 +298,221 @@ int main() {
             if (!engine) {
               return crow::response(404, "Model not found");
             }
-            auto all_data = engine->get_all();
-            nlohmann::json result = nlohmann::json::object();
+            // the object is written straight from the scan, without holding
+            // all pairs or a json tree of them in memory
+            auto it = engine->get_all();
             auto search_term = req.url_params.get("search");
-            if (search_term) {
-              std::string lower_search = to_lower(search_term);
-              for (const auto &[key, value_str] : all_data) {
-                // searching in the key string
-                std::string lower_key = to_lower(key);
-                if (lower_key.find(lower_search) != std::string::npos) {
-                  try {
-                    auto value_json = nlohmann::json::parse(value_str);
-                    result[key] = value_json;
-                  } catch (const std::exception &e) {
-                    result[key] = value_str;
-                  }
-                }
-                // searching in the val
-                std::string lower_val = to_lower(value_str);
-                if (lower_val.find(lower_search) != std::string::npos) {
-                  try {
-                    auto value_json = nlohmann::json::parse(value_str);
-                    result[key] = value_json;
-                  } catch (const std::exception &e) {
-                    result[key] = value_str;
-                  }
-                }
+            std::string lower_search =
+                search_term ? to_lower(search_term) : std::string();
+            crow::response res;
+            res.body = "{";
+            bool first = true;
+            std::string_view key, value_str;
+            while (it.next(key, value_str)) {
+              if (is_index_key(key))
+                continue;
+              if (search_term) {
+                // searching in the key string and in the val
+                std::string lower_key = to_lower(std::string(key));
+                std::string lower_val = to_lower(std::string(value_str));
+                if (lower_key.find(lower_search) == std::string::npos &&
+                    lower_val.find(lower_search) == std::string::npos)
+                  continue;
               }
-            } else {
-              for (const auto &[key, value_str] : all_data) {
-                try {
-                  auto value_json = nlohmann::json::parse(value_str);
-                  result[key] = value_json;
-                } catch (const std::exception &e) {
-                  result[key] = value_str;
+              if (!first)
+                res.body += ',';
+              first = false;
+              append_json_pair(res.body, key, value_str);
+            }
+            res.body += '}';
+            return res;
+          });
+
+  // GET /{model}/_stats - Cache counters of the model
+  CROW_ROUTE(app, "/<string>/_stats")
+      .methods("GET"_method)(
+          [&get_engine](const crow::request &req, std::string model) {
+            auto engine = get_engine(model);
+            if (!engine) {
+              return crow::response(404, "Model not found");
+            }
+            auto stats = engine->cacheStats();
+            nlohmann::json result = {{"hits", stats.hits},
+                                     {"misses", stats.misses},
+                                     {"evictions", stats.evictions},
+                                     {"rejected", stats.rejected},
+                                     {"entries", stats.entries},
+                                     {"bytes", stats.bytes}};
+            return crow::response(result.dump());
+          });
+
+  // POST /{model}/_mget - Get many keys at once, body is a JSON array of keys
+  CROW_ROUTE(app, "/<string>/_mget")
+      .methods("POST"_method)(
+          [&get_engine](const crow::request &req, std::string model) {
+            auto engine = get_engine(model);
+            if (!engine) {
+              return crow::response(404, "Model not found");
+            }
+            std::vector<std::string> keys;
+            try {
+              keys = nlohmann::json::parse(req.body)
+                         .get<std::vector<std::string>>();
+            } catch (const std::exception &e) {
+              return crow::response(400, "Invalid JSON");
+            }
+            auto values = engine->multi_get(keys);
+            // missing keys come back as null
+            nlohmann::json result = nlohmann::json::object();
+            for (size_t i = 0; i < keys.size(); i++) {
+              if (!values[i]) {
+                result[keys[i]] = nullptr;
+                continue;
+              }
+              try {
+                result[keys[i]] = nlohmann::json::parse(values[i]->value());
+              } catch (const std::exception &e) {
+                result[keys[i]] = values[i]->str();
+              }
+            }
+            return crow::response(result.dump());
+          });
+
+  // POST /{model}/_batch - Apply a list of writes together, body is
+  // [{"op": "put", "key": "...", "value": ...}, ...]
+  CROW_ROUTE(app, "/<string>/_batch")
+      .methods("POST"_method)(
+          [&get_engine, &update_index](const crow::request &req,
+                                       std::string model) {
+            auto engine = get_engine(model);
+            if (!engine) {
+              return crow::response(404, "Model not found");
+            }
+            std::vector<std::pair<std::string, std::string>> ops;
+            std::vector<std::pair<std::string, const nlohmann::json *>> writes;
+            nlohmann::json json;
+            try {
+              json = nlohmann::json::parse(req.body);
+              if (!json.is_array()) {
+                return crow::response(400, "Expected an array of ops");
+              }
+              for (const auto &op : json) {
+                if (op.value("op", "") != "put") {
+                  return crow::response(400, "Unsupported op");
                 }
+                ops.emplace_back(op.at("key").get<std::string>(),
+                                 op.at("value").dump());
+                writes.emplace_back(ops.back().first, &op.at("value"));
               }
+            } catch (const std::exception &e) {
+              return crow::response(400, "Invalid JSON");
+            }
+            engine->write_batch(ops);
+            update_index(model, writes);
+            return crow::response(200, "OK");
+          });
+
+  // GET /{model}/_scan?prefix=...&limit=... - Keys starting with prefix, in
+  // order
+  CROW_ROUTE(app, "/<string>/_scan")
+      .methods("GET"_method)(
+          [&get_engine](const crow::request &req, std::string model) {
+            auto engine = get_engine(model);
+            if (!engine) {
+              return crow::response(404, "Model not found");
+            }
+            auto prefix = req.url_params.get("prefix");
+            try {
+              std::string from = prefix ? prefix : "";
+              return pairs_response(document_range(
+                  *engine, from, kv::StorageEngine::prefixEnd(from),
+                  limit_param(req)));
+            } catch (const std::exception &e) {
+              return crow::response(400, "Invalid limit");
+            }
+          });
+
+  // GET /{model}/_range?start=...&end=...&limit=... - Keys in [start, end),
+  // in order
+  CROW_ROUTE(app, "/<string>/_range")
+      .methods("GET"_method)(
+          [&get_engine](const crow::request &req, std::string model) {
+            auto engine = get_engine(model);
+            if (!engine) {
+              return crow::response(404, "Model not found");
+            }
+            auto start = req.url_params.get("start");
+            auto end = req.url_params.get("end");
+            try {
+              return pairs_response(document_range(
+                  *engine, start ? start : "", end ? end : "",
+                  limit_param(req)));
+            } catch (const std::exception &e) {
+              return crow::response(400, "Invalid limit");
+            }
+          });
+
+  // POST /{model}/_reindex - Rebuild the search index of the model from all
+  // of its JSON object values. Documents are tokenized in parallel and
+  // written a batch at a time
+  CROW_ROUTE(app, "/<string>/_reindex")
+      .methods("POST"_method)([&get_engine, &get_index, &pool](
+                                  const crow::request &req, std::string model) {
+        auto engine = get_engine(model);
+        auto index = get_index(model);
+        if (!engine || !index) {
+          return crow::response(404, "Model not found");
+        }
+        static constexpr size_t BATCH_DOCS = 4096;
+
+        // the iterator is a snapshot from before clear(), it holds no locks
+        // and never sees the keys the new index writes
+        auto it = engine->get_all();
+        index->clear();
+        size_t indexed = 0;
+        std::vector<std::pair<std::string, nlohmann::json>> docs;
+        std::string_view key, val;
+        while (it.next(key, val)) {
+          if (is_index_key(key)) {
+            continue;
+          }
+          auto json = nlohmann::json::parse(val, nullptr, false);
+          if (json.is_object()) {
+            docs.emplace_back(std::string(key), std::move(json));
+          }
+          if (docs.size() == BATCH_DOCS) {
+            indexed += index->indexBatch(docs, pool);
+            docs.clear();
+          }
+        }
+        indexed += index->indexBatch(docs, pool);
+        nlohmann::json result = {{"indexed", indexed}};
+        return crow::response(result.dump());
+      });
+
+  // GET /{model}/_search?q=...&k=...&op=all|any - Documents matching q, best
+  // BM25 score first
+  CROW_ROUTE(app, "/<string>/_search")
+      .methods("GET"_method)(
+          [&get_index](const crow::request &req, std::string model) {
+            auto index = get_index(model);
+            if (!index) {
+              return crow::response(404, "Model not found");
+            }
+            auto q = req.url_params.get("q");
+            auto k = req.url_params.get("k");
+            auto op = req.url_params.get("op");
+            kv::Match match = op && to_lower(op) == "any" ? kv::Match::Any
+                                                           : kv::Match::All;
+            std::vector<kv::SearchHit> hits;
+            try {
+              hits = index->query(q ? q : "", k ? std::stoul(k) : 10, match);
+            } catch (const std::exception &e) {
+              return crow::response(400, "Invalid k");
+            }
+            nlohmann::json result = nlohmann::json::array();
+            for (const auto &hit : hits) {
+              result.push_back({{"key", hit.docId}, {"score", hit.score}});
             }
             return crow::response(result.dump());
           });
@@ -156,27 +525,28 @@ int main() {
         if (!engine) {
           return crow::response(404, "Model not found");
         }
-        auto value_opt = engine->get(key);
-        if (value_opt) {
-          try {
-            auto value_json = nlohmann::json::parse(*value_opt);
-            return crow::response(value_json.dump());
-          } catch (const std::exception &e) {
-            return crow::response(*value_opt);
-          }
-        } else {
+        // values are stored as they were posted (dumped JSON), so the bytes
+        // go out as is instead of being parsed and dumped again
+        crow::response res;
+        if (!engine->get_view(key, [&res](std::string_view val) {
+              res.body.assign(val.data(), val.size());
+            })) {
           return crow::response(404, "Key not found");
         }
+        return res;
       });
 
   // DELETE /{model} - Delete the entire model
   CROW_ROUTE(app, "/<string>")
       .methods("DELETE"_method)(
-          [&config, &model_engines](const crow::request &req,
-                                    std::string model) {
+          [&config, &model_engines, &model_indexes](const crow::request &req,
+                                                    std::string model) {
             std::string model_dir = config.data_dir + "/" + model;
             if (fs::exists(model_dir)) {
-              model_engines.erase(model);
+              // requests still running on the model keep their copies, the
+              // files go once the last of them is done
+              model_indexes.take(model);
+              model_engines.take(model);
               fs::remove_all(model_dir);
               return crow::response(200, "Model deleted");
             } else {
@@ -186,14 +556,15 @@ int main() {
 
   // DELETE /{model}/{key} - Delete specific key in the model
   CROW_ROUTE(app, "/<string>/<string>")
-      .methods("DELETE"_method)([&get_engine](const crow::request &req,
-                                              std::string model,
-                                              std::string key) {
+      .methods("DELETE"_method)([&get_engine, &update_index](
+                                    const crow::request &req,
+                                    std::string model, std::string key) {
         auto engine = get_engine(model);
         if (!engine) {
           return crow::response(404, "Model not found");
         }
         if (engine->erase(key)) {
+          update_index(model, {{key, nullptr}});
           return crow::response(200, "Key deleted");
         } else {
           return crow::response(404, "Key not found");
@@ -0,0 +1,90 @@
+#include "../include/kv/ordered_index.hpp"
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+namespace kv {
+
+// the leaf whose first key is the last one not above key, so the leaf key
+// belongs in (or the first leaf for keys below everything)
+size_t OrderedIndex::leafFor(std::string_view key) const {
+  auto it = std::upper_bound(leaves.begin(), leaves.end(), key,
+                             [](std::string_view k,
+                                const std::vector<std::string> &leaf) {
+                               return k < leaf.front();
+                             });
+  return it == leaves.begin() ? 0 : std::distance(leaves.begin(), it) - 1;
+}
+
+void OrderedIndex::insert(std::string_view key) {
+  if (leaves.empty()) {
+    leaves.emplace_back();
+    leaves.back().emplace_back(key);
+    ++count;
+    return;
+  }
+  size_t l = leafFor(key);
+  auto &leaf = leaves[l];
+  auto it = std::lower_bound(leaf.begin(), leaf.end(), key);
+  if (it != leaf.end() && *it == key)
+    return;
+  leaf.emplace(it, key);
+  ++count;
+  // split a full leaf in halves, the upper half becomes the next leaf
+  if (leaf.size() > LEAF_KEYS) {
+    std::vector<std::string> upper(
+        std::make_move_iterator(leaf.begin() + leaf.size() / 2),
+        std::make_move_iterator(leaf.end()));
+    leaf.resize(leaf.size() / 2);
+    leaves.insert(leaves.begin() + l + 1, std::move(upper));
+  }
+}
+
+// leaves are never merged, one only goes away once it is empty
+void OrderedIndex::erase(std::string_view key) {
+  if (leaves.empty())
+    return;
+  size_t l = leafFor(key);
+  auto &leaf = leaves[l];
+  auto it = std::lower_bound(leaf.begin(), leaf.end(), key);
+  if (it == leaf.end() || *it != key)
+    return;
+  leaf.erase(it);
+  --count;
+  if (leaf.empty())
+    leaves.erase(leaves.begin() + l);
+}
+
+// packs the leaves three quarters full, so the first inserts after a restart
+// do not split every leaf they touch
+void OrderedIndex::build(std::vector<std::string> keys) {
+  leaves.clear();
+  count = keys.size();
+  const size_t fill = LEAF_KEYS * 3 / 4;
+  leaves.reserve((keys.size() + fill - 1) / fill);
+  for (size_t i = 0; i < keys.size(); i += fill) {
+    size_t n = std::min(fill, keys.size() - i);
+    leaves.emplace_back(std::make_move_iterator(keys.begin() + i),
+                        std::make_move_iterator(keys.begin() + i + n));
+  }
+}
+
+void OrderedIndex::range(std::string_view start, std::string_view end,
+                         const KeyVisitor &visit) const {
+  if (leaves.empty())
+    return;
+  size_t l = leafFor(start);
+  size_t i = std::lower_bound(leaves[l].begin(), leaves[l].end(), start) -
+             leaves[l].begin();
+  for (; l < leaves.size(); ++l, i = 0) {
+    const auto &leaf = leaves[l];
+    for (; i < leaf.size(); ++i) {
+      if (!end.empty() && std::string_view(leaf[i]) >= end)
+        return;
+      if (!visit(leaf[i]))
+        return;
+    }
+  }
+}
+
+} // namespace kv
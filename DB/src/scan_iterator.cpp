@@ -0,0 +1,32 @@
+#include "../include/kv/scan_iterator.hpp"
+#include <utility>
+
+namespace kv {
+
+ScanIterator::ScanIterator(std::vector<ScanSnapshot> shards)
+    : shards(std::move(shards)) {}
+
+bool ScanIterator::next(std::string_view &key, std::string_view &val) {
+  while (shard < shards.size()) {
+    auto &snap = shards[shard];
+    while (pos < snap.live.size()) {
+      const KeyDirEntry &at = snap.live[pos++];
+      // both lists are ordered by segment id, so the reader only moves forward
+      while (seg < snap.segments.size() &&
+             snap.segments[seg].getId() < at.segment_id)
+        ++seg;
+      if (seg == snap.segments.size() ||
+          snap.segments[seg].getId() != at.segment_id)
+        continue;
+      if (snap.segments[seg].record(at.offset, at.size, key, val))
+        return true;
+    }
+    // done with this shard, let go of its files
+    snap = ScanSnapshot();
+    ++shard;
+    pos = seg = 0;
+  }
+  return false;
+}
+
+} // namespace kv
@@ -1,162 +1,631 @@
 #include "../include/kv/segment.hpp"
+#include "../include/kv/hash_func.hpp"
 #include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <ios>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
 namespace kv {
 
-Segment::Segment(size_t id, const std::string &dir, size_t seg_size)
-    : id(id), seg_file_path(dir + "/segment_" + std::to_string(id) + ".kv"),
-      ind_file_path(dir + "/segment_" + std::to_string(id) + ".idx"),
-      bf_file_path(dir + "/segment_" + std::to_string(id) + ".bf"), local_ind(),
-      bf(8 * 1024, 4) // 8KB bloom filter with 4 hashes
-{
-  // open (or create) data file for append + read
-  data.open(seg_file_path,
-            std::ios::in | std::ios::out | std::ios::app | std::ios::binary);
-  if (!data.is_open()) {
-    // create the file if not present
-    std::ofstream create(seg_file_path, std::ios::binary);
-    create.close();
-    data.open(seg_file_path,
-              std::ios::in | std::ios::out | std::ios::app | std::ios::binary);
-  }
-  // load current index map or bloom filter if present
-  loadBloom();
-  loadIndex();
+// bytes between the length prefix and the key
+static constexpr size_t FIXED_HDR = sizeof(RecordHeader::key_len) +
+                                    sizeof(RecordHeader::val_len) +
+                                    sizeof(RecordHeader::flags) +
+                                    sizeof(RecordHeader::codec);
+
+// decodes a record body (everything after record_len) of recordLen bytes,
+// false if the lengths inside do not add up. Without verify the crc is not
+// computed and crcOk is always true
+static bool decodeRecord(const char *body, uint32_t recordLen,
+                         RecordHeader &header, std::string_view &key,
+                         std::string_view &val, bool &crcOk,
+                         bool verify = true) {
+  if (recordLen < FIXED_HDR + sizeof(uint32_t))
+    return false;
+  header.record_len = recordLen;
+  const char *p = body;
+  std::memcpy(&header.key_len, p, sizeof(header.key_len));
+  p += sizeof(header.key_len);
+  std::memcpy(&header.val_len, p, sizeof(header.val_len));
+  p += sizeof(header.val_len);
+  std::memcpy(&header.flags, p, sizeof(header.flags));
+  p += sizeof(header.flags);
+  std::memcpy(&header.codec, p, sizeof(header.codec));
+  p += sizeof(header.codec);
+  if (size_t(header.key_len) + header.val_len + FIXED_HDR + sizeof(uint32_t) !=
+      recordLen)
+    return false;
+  key = std::string_view(p, header.key_len);
+  val = std::string_view(p + header.key_len, header.val_len);
+
+  crcOk = true;
+  if (!verify)
+    return true;
+  size_t crcLen = recordLen - sizeof(uint32_t);
+  uint32_t storedCrc;
+  std::memcpy(&storedCrc, body + crcLen, sizeof(storedCrc));
+  const auto *bytes = reinterpret_cast<const uint8_t *>(body);
+  crcOk = (header.flags & RECORD_CRC32C ? utils::crc32c(bytes, crcLen)
+                                        : utils::crc32(bytes, crcLen)) ==
+          storedCrc;
+  if (!crcOk && header.flags == 0) {
+    // erase used to flip the flag byte in place without touching the crc,
+    // such a tombstone is intact if it checks out with the flag still set
+    std::string copy(body, crcLen);
+    copy[sizeof(header.key_len) + sizeof(header.val_len)] = 1;
+    crcOk = utils::crc32(reinterpret_cast<const uint8_t *>(copy.data()),
+                         crcLen) == storedCrc;
+  }
+  return true;
 }
 
-Segment::~Segment() {
-  saveBloom();
-  saveIndex();
-  data.close();
+// header in front of the .idx and .bf snapshots, it ties a snapshot to the
+// prefix of the .kv file it describes so a stale one is never trusted
+struct SnapshotHeader {
+  uint64_t magic;
+  uint64_t covered; // .kv bytes accounted for
+  uint64_t dead;    // dead bytes of the segment when it was taken
+  uint64_t count;   // index entries that follow, unused by .bf
+};
+static constexpr uint64_t IDX_MAGIC = 0x3430584449564b44ull; // "DKVIDX04"
+static constexpr uint64_t BF_MAGIC = 0x3330304642564b44ull;  // "DKVBF003"
+
+// snapshots go to a temp file first so a crash never leaves half of one
+static std::ofstream openSnapshot(const std::string &path) {
+  return std::ofstream(path + ".tmp", std::ios::binary | std::ios::trunc);
 }
 
-// for inserting the data in the segment file
-size_t Segment::appendRecord(uint64_t hash, std::string_view key,
-                             std::string_view val) {
-  // move the file pointer to the end and note the offset
-  data.seekp(0, std::ios::end);
-  size_t offset = static_cast<size_t>(data.tellp());
+static void commitSnapshot(std::ofstream &out, const std::string &path) {
+  out.close();
+  std::error_code ec;
+  if (out)
+    std::filesystem::rename(path + ".tmp", path, ec);
+  else
+    std::filesystem::remove(path + ".tmp", ec);
+}
+
+// suffix is appended to every file name, compaction uses it to build the
+// merged segment next to the live one before swapping it in
+Segment::Segment(size_t id, const std::string &dir, const BloomSizing &bloom,
+                 HashFn hash,
+                 std::shared_ptr<const Compressor> compressor,
+                 const std::string &suffix)
+    : id(id),
+      seg_file_path(dir + "/segment_" + std::to_string(id) + ".kv" + suffix),
+      ind_file_path(dir + "/segment_" + std::to_string(id) + ".idx" + suffix),
+      bf_file_path(dir + "/segment_" + std::to_string(id) + ".bf" + suffix),
+      bloom_sizing(bloom), bf(BloomFilter::forKeys(0, bloom)),
+      compressor(std::move(compressor)), hash_fn(hash) {
+  // open (or create) data file, every write lands at the end
+  fd = ::open(seg_file_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+    throw std::system_error(errno, std::generic_category(), seg_file_path);
+  file_size = static_cast<size_t>(std::filesystem::file_size(seg_file_path));
+  recover();
+}
+
+// brings the in-memory index up to date with the .kv file: trust whatever
+// the snapshots cover and only scan the records written after them, so the
+// cost is the unindexed tail and not the whole segment
+void Segment::recover() {
+  using clock = std::chrono::steady_clock;
+  auto ms = [](clock::time_point from) {
+    return std::chrono::duration<double, std::milli>(clock::now() - from)
+        .count();
+  };
+
+  auto t = clock::now();
+  size_t covered = loadIndex();
+  times.index_ms = ms(t);
+
+  t = clock::now();
+  bool bloom_loaded = covered > 0 && loadBloom(covered);
+  if (!bloom_loaded)
+    bf = buildBloom(entries.size());
+  times.bloom_ms = ms(t);
+  if (covered >= file_size) {
+    snapshot_fresh = bloom_loaded || file_size == 0;
+    return;
+  }
 
+  t = clock::now();
+  size_t end = scan(
+      [&](size_t off, const RecordHeader &header, std::string_view key,
+          std::string_view, bool crcOk) {
+        if (!crcOk)
+          return; // framing holds but the payload does not, leave it out
+        index(hash_fn(key), key, off,
+              sizeof(header.record_len) + header.record_len,
+              !(header.flags & RECORD_LIVE));
+      },
+      covered);
+
+  // a torn record at the tail, cut it off so appends start on a boundary
+  if (end < file_size)
+    truncate(end);
+  times.scan_ms = ms(t);
+  times.scanned = end - covered;
+}
+
+Segment::~Segment() {
+  if (persist) {
+    saveBloom();
+    saveIndex();
+  }
+  if (fd >= 0)
+    ::close(fd);
+}
+
+// appends the encoded form of one record to buf, crc computed in memory, and
+// returns the number of bytes added. val is stored as given, codec says how
+// it was compressed. A tombstone carries no value
+size_t Segment::encodeRecord(std::string &buf, std::string_view key,
+                             std::string_view val, bool tombstone,
+                             Codec codec) {
+  if (tombstone) {
+    val = std::string_view();
+    codec = Codec::Raw;
+  }
   // preparing the record header
   RecordHeader header;
   header.key_len = static_cast<uint32_t>(key.size());
   header.val_len = static_cast<uint32_t>(val.size());
-  header.flags = (val.size() == 0) ? 0 : 1; // 1 means alive, 0 means tombstone
-  header.reserved = 0;                      // for future
+  header.flags = RECORD_CRC32C | (tombstone ? 0 : RECORD_LIVE);
+  header.codec = static_cast<uint8_t>(codec);
 
   // compute total length after header and everything
-  header.record_len = sizeof(header.key_len) + sizeof(header.val_len) +
-                      sizeof(header.flags) + sizeof(header.reserved) +
-                      header.key_len + header.val_len +
+  header.record_len = FIXED_HDR + header.key_len + header.val_len +
                       sizeof(uint32_t); // for crc32
 
-  // write the header
-  data.write(reinterpret_cast<char *>(&header.record_len),
-             sizeof(header.record_len));
-  data.write(reinterpret_cast<char *>(&header.key_len), sizeof(header.key_len));
-  data.write(reinterpret_cast<char *>(&header.val_len), sizeof(header.val_len));
-  data.write(reinterpret_cast<char *>(&header.flags), sizeof(header.flags));
-  data.write(reinterpret_cast<char *>(&header.reserved),
-             sizeof(header.reserved));
+  size_t start = buf.size();
+  buf.resize(start + sizeof(header.record_len) + header.record_len);
+  char *p = buf.data() + start;
+  std::memcpy(p, &header.record_len, sizeof(header.record_len));
+  p += sizeof(header.record_len);
+  char *crcStart = p;
+  std::memcpy(p, &header.key_len, sizeof(header.key_len));
+  p += sizeof(header.key_len);
+  std::memcpy(p, &header.val_len, sizeof(header.val_len));
+  p += sizeof(header.val_len);
+  std::memcpy(p, &header.flags, sizeof(header.flags));
+  p += sizeof(header.flags);
+  std::memcpy(p, &header.codec, sizeof(header.codec));
+  p += sizeof(header.codec);
+  if (header.key_len)
+    std::memcpy(p, key.data(), header.key_len);
+  p += header.key_len;
+  if (header.val_len)
+    std::memcpy(p, val.data(), header.val_len);
+  p += header.val_len;
 
-  // writing the data in the file
-  data.write(key.data(), header.key_len);
-  data.write(val.data(), header.val_len);
+  uint32_t crc = utils::crc32c(reinterpret_cast<uint8_t *>(crcStart),
+                               static_cast<size_t>(p - crcStart));
+  std::memcpy(p, &crc, sizeof(crc));
+  return buf.size() - start;
+}
 
-  // computing crc
-  size_t crcStart = offset + sizeof(header.record_len);
-  size_t crcLen = header.record_len - sizeof(uint32_t);
-  std::vector<char> buf(crcLen);
-  data.seekg(crcStart);
-  data.read(buf.data(), crcLen);
-  uint32_t crc = utils::crc32(reinterpret_cast<uint8_t *>(buf.data()), crcLen);
+// one write for a whole batch of encoded records, retried on short writes.
+// A failed batch is cut off again, or a later recovery would pick up the part
+// that made it to the file
+void Segment::writeRaw(const char *buf, size_t len) {
+  size_t start = file_size;
+  while (len > 0) {
+    ssize_t n = ::write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      int err = errno;
+      truncate(start);
+      throw std::system_error(err, std::generic_category(), seg_file_path);
+    }
+    buf += n;
+    len -= static_cast<size_t>(n);
+    file_size += static_cast<size_t>(n);
+  }
+}
 
-  // Write CRC
-  data.write(reinterpret_cast<char *>(&crc), sizeof(crc));
+// records a record written at offset for the snapshot and the filter, the
+// filter is rebuilt at twice the size whenever the key count outgrows it
+void Segment::index(uint64_t hash, std::string_view key, size_t offset,
+                    size_t size, bool tombstone) {
+  entries.push_back({hash, offset, static_cast<uint32_t>(size),
+                     static_cast<uint32_t>(key.size()), tombstone});
+  entry_keys.append(key);
+  if (entries.size() > bf.capacity())
+    bf = buildBloom(2 * entries.size());
+  else
+    bf.add(hash);
+}
 
-  data.flush();
+// a filter sized for keys holding every key currently in the index
+BloomFilter Segment::buildBloom(size_t keys) const {
+  BloomFilter filter = BloomFilter::forKeys(keys, bloom_sizing);
+  for (auto &e : entries) {
+    filter.add(e.hash);
+  }
+  return filter;
+}
 
-  // update the local index and bloom filter
-  bf.add(hash);
-  local_ind.put(hash, offset);
+// walks the entries in append order together with their keys
+void Segment::visitIndex(const IndexVisitor &visit) const {
+  size_t at = 0;
+  for (auto &e : entries) {
+    visit(e, std::string_view(entry_keys).substr(at, e.key_len));
+    at += e.key_len;
+  }
+}
 
+// drops the entries live() rejects, versions overwritten inside the segment
+// need not be in its snapshot
+void Segment::pruneIndex(
+    const std::function<bool(const IndexEntry &, std::string_view)> &live) {
+  std::vector<IndexEntry> kept;
+  std::string kept_keys;
+  kept.reserve(entries.size());
+  visitIndex([&](const IndexEntry &e, std::string_view key) {
+    if (!live(e, key))
+      return;
+    kept.push_back(e);
+    kept_keys.append(key);
+  });
+  entries = std::move(kept);
+  entry_keys = std::move(kept_keys);
+}
+
+// once the keydir holds a sealed segment's entries the segment has no use
+// for its own copy, make sure the snapshot is on disk and let it go
+void Segment::releaseIndex() {
+  if (!snapshot_fresh) {
+    saveIndex();
+    saveBloom();
+    snapshot_fresh = true;
+  }
+  std::vector<IndexEntry>().swap(entries);
+  std::string().swap(entry_keys);
+  persist = false;
+}
+
+// pushes everything written so far to stable storage
+void Segment::sync() {
+  if (::fdatasync(fd) != 0)
+    throw std::system_error(errno, std::generic_category(), seg_file_path);
+}
+
+// cuts the file back to end bytes, file_size follows only if that worked so
+// it keeps matching where the next append lands
+bool Segment::truncate(size_t end) {
+  if (::ftruncate(fd, static_cast<off_t>(end)) != 0)
+    return false;
+  file_size = end;
+  return true;
+}
+
+// for inserting the data in the segment file
+size_t Segment::appendRecord(uint64_t hash, std::string_view key,
+                             std::string_view val, bool tombstone,
+                             Codec codec) {
+  size_t offset = file_size;
+  std::string buf;
+  size_t size = encodeRecord(buf, key, val, tombstone, codec);
+  writeRaw(buf.data(), buf.size());
+
+  // update the local index and bloom filter
+  index(hash, key, offset, size, tombstone);
   return offset;
 }
 
-// load the bloom filter by the segment's .bf file
-void Segment::loadBloom() {
+// load the bloom filter by the segment's .bf file, only if it was taken
+// together with the index snapshot covering `covered` bytes
+bool Segment::loadBloom(size_t covered) {
   if (!std::filesystem::exists(bf_file_path))
-    return;
+    return false;
   std::ifstream in(bf_file_path, std::ios::binary);
-  size_t bitsize;
-  in.read(reinterpret_cast<char *>(&bitsize), sizeof(bitsize));
-  bf = BloomFilter(bitsize, bf.getNumHashes());
-  std::vector<char> raw(bitsize);
-  in.read(raw.data(), bitsize);
-  // unpack bits
-  for (size_t i = 0; i < bitsize; ++i) {
-    bf.setBit(i, raw[i]);
-  }
+  SnapshotHeader hdr;
+  uint64_t shape[2]; // bit count, key capacity
+  if (!in.read(reinterpret_cast<char *>(&hdr), sizeof(hdr)) ||
+      hdr.magic != BF_MAGIC || hdr.covered != covered ||
+      !in.read(reinterpret_cast<char *>(shape), sizeof(shape)) ||
+      shape[0] == 0 || shape[0] % BloomFilter::BLOCK_BITS != 0 ||
+      std::filesystem::file_size(bf_file_path) !=
+          sizeof(hdr) + sizeof(shape) + shape[0] / 8)
+    return false;
+  BloomFilter filter(shape[0], shape[1]);
+  if (!in.read(filter.data(), filter.byteSize()))
+    return false;
+  bf = std::move(filter);
+  return true;
 }
 
 // saves the bloom filter by writing it to the segment's specific .bf file
 void Segment::saveBloom() {
-  std::ofstream out(bf_file_path, std::ios::binary);
-  size_t bitsize = bf.size();
-  out.write(reinterpret_cast<char *>(&bitsize), sizeof(bitsize));
-  std::vector<char> raw(bitsize);
-  // pack bits
-  for (size_t i = 0; i < bitsize; i++) {
-    raw[i] = bf.getBit(i);
-  }
-  out.write(raw.data(), bitsize);
+  std::ofstream out = openSnapshot(bf_file_path);
+  SnapshotHeader hdr{BF_MAGIC, file_size, dead_bytes, 0};
+  uint64_t shape[2] = {bf.size(), bf.capacity()};
+  out.write(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+  out.write(reinterpret_cast<char *>(shape), sizeof(shape));
+  out.write(bf.data(), bf.byteSize());
+  commitSnapshot(out, bf_file_path);
 }
 
-// loads the index (.idx) file into the local index map
-void Segment::loadIndex() {
+// loads the index (.idx) file into entries, returns how many
+// bytes of the .kv file it covers, 0 when it is missing, torn or stale
+size_t Segment::loadIndex() {
   if (!std::filesystem::exists(ind_file_path))
-    return;
+    return 0;
   std::ifstream in(ind_file_path, std::ios::binary);
-  uint64_t hash;
-  uint64_t off;
-  while (in.read(reinterpret_cast<char *>(&hash), sizeof(hash))) {
-    in.read(reinterpret_cast<char *>(&off), sizeof(off));
-    local_ind.put(hash, static_cast<size_t>(off));
+  SnapshotHeader hdr;
+  if (!in.read(reinterpret_cast<char *>(&hdr), sizeof(hdr)) ||
+      hdr.magic != IDX_MAGIC || hdr.covered > file_size ||
+      std::filesystem::file_size(ind_file_path) <
+          sizeof(hdr) + hdr.count * sizeof(IndexEntry))
+    return 0;
+  // one read for all entries and one for all keys, whose total length has
+  // to match what is left of the file
+  entries.resize(hdr.count);
+  size_t key_bytes = 0;
+  if (in.read(reinterpret_cast<char *>(entries.data()),
+              entries.size() * sizeof(IndexEntry))) {
+    for (auto &e : entries) {
+      key_bytes += e.key_len;
+    }
+    entry_keys.resize(key_bytes);
   }
+  if (!in || std::filesystem::file_size(ind_file_path) !=
+                 sizeof(hdr) + hdr.count * sizeof(IndexEntry) + key_bytes ||
+      !in.read(entry_keys.data(), key_bytes)) {
+    entries.clear();
+    entry_keys.clear();
+    return 0;
+  }
+  // as of the snapshot, buildKeyDir settles the exact figure once every
+  // segment has been replayed
+  dead_bytes = hdr.dead;
+  return hdr.covered;
 }
 
-// saves the local index onto the .idx file
+// saves the entries onto the .idx file
 void Segment::saveIndex() {
-  std::ofstream out(ind_file_path, std::ios::binary | std::ios::trunc);
-  std::vector<std::pair<uint64_t, size_t>> indexList = local_ind.get_all();
-  for (auto &p : indexList) {
-    uint64_t hash = p.first;
-    uint64_t off = p.second;
-    out.write(reinterpret_cast<char *>(&hash), sizeof(hash));
-    out.write(reinterpret_cast<char *>(&off), sizeof(off));
+  std::ofstream out = openSnapshot(ind_file_path);
+  SnapshotHeader hdr{IDX_MAGIC, file_size, dead_bytes, entries.size()};
+  out.write(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+  out.write(reinterpret_cast<const char *>(entries.data()),
+            entries.size() * sizeof(IndexEntry));
+  out.write(entry_keys.data(), entry_keys.size());
+  commitSnapshot(out, ind_file_path);
+}
+
+// a closed segment never changes again, so map it once and serve reads from
+// memory
+void Segment::seal() {
+  if (map || fd < 0 || file_size == 0)
+    return;
+  void *p = ::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return; // reads keep going through pread
+  map = static_cast<const char *>(p);
+  map_len = file_size;
+  // views handed out by read() keep the mapping alive after the segment is
+  // gone, compaction may delete it while a caller still holds a value. Stored
+  // atomically and after map_len, read() may be running without any lock
+  std::atomic_store(
+      &mapping, std::shared_ptr<const char>(map, [len = map_len](const char *m) {
+        ::munmap(const_cast<char *>(m), len);
+      }));
+}
+
+// reads the value stored at offset, nullopt for tombstones, hash collisions
+// and records that fail their crc or do not decompress. Without verify the
+// crc is skipped, scans and compaction still check it. Safe next to appends
+// and seal()
+std::optional<ValueView> Segment::read(size_t offset, std::string_view key,
+                                       bool verify) const {
+  uint32_t recordLen;
+  const char *body;
+  std::shared_ptr<const void> owner;
+  if (auto mapped = std::atomic_load(&mapping)) {
+    if (offset + sizeof(recordLen) > map_len)
+      return std::nullopt;
+    std::memcpy(&recordLen, mapped.get() + offset, sizeof(recordLen));
+    if (offset + sizeof(recordLen) + recordLen > map_len)
+      return std::nullopt;
+    body = mapped.get() + offset + sizeof(recordLen);
+    owner = std::move(mapped);
+  } else {
+    // the active segment, one pread for the length and one for the rest
+    if (::pread(fd, &recordLen, sizeof(recordLen), offset) !=
+        static_cast<ssize_t>(sizeof(recordLen)))
+      return std::nullopt;
+    // the length comes off the disk, a corrupt one is turned away like a
+    // failed checksum before it can size the buffer
+    if (offset + sizeof(recordLen) + recordLen > file_size)
+      return std::nullopt;
+    auto buf = std::make_shared<std::string>(recordLen, '\0');
+    if (::pread(fd, buf->data(), recordLen, offset + sizeof(recordLen)) !=
+        static_cast<ssize_t>(recordLen))
+      return std::nullopt;
+    body = buf->data();
+    owner = std::move(buf);
+  }
+
+  RecordHeader header;
+  std::string_view k, v;
+  bool crcOk;
+  if (!decodeRecord(body, recordLen, header, k, v, crcOk, verify))
+    return std::nullopt;
+  // If tombstone, treat as not found
+  if (!(header.flags & RECORD_LIVE))
+    return std::nullopt;
+  // a different key with the same hash
+  if (k != key)
+    return std::nullopt;
+  if (!crcOk) {
+    // data corruption!
+    return std::nullopt;
+  }
+  if (header.codec != static_cast<uint8_t>(Codec::Raw)) {
+    auto unpacked = std::make_shared<std::string>();
+    if (!compressor ||
+        !compressor->decompress(Codec(header.codec), v, *unpacked))
+      return std::nullopt;
+    v = *unpacked;
+    owner = std::move(unpacked);
+  }
+  return ValueView(std::move(owner), v);
+}
+
+// a mapped segment shares the mapping, the active one gets its own
+// descriptor so the reader survives the segment being sealed and dropped
+SegmentReader Segment::reader() const {
+  if (map)
+    return SegmentReader(id, mapping, map_len, -1, compressor);
+  int own = ::dup(fd);
+  if (own < 0)
+    throw std::system_error(errno, std::generic_category(), seg_file_path);
+  return SegmentReader(id, nullptr, 0, own, compressor);
+}
+
+SegmentReader::SegmentReader(size_t id, std::shared_ptr<const char> map,
+                             size_t map_len, int fd,
+                             std::shared_ptr<const Compressor> compressor)
+    : id(id), map(std::move(map)), map_len(map_len), fd(fd),
+      compressor(std::move(compressor)) {}
+
+SegmentReader::SegmentReader(SegmentReader &&o) noexcept
+    : id(o.id), map(std::move(o.map)), map_len(o.map_len), fd(o.fd),
+      block(std::move(o.block)), block_off(o.block_off),
+      compressor(std::move(o.compressor)), unpacked(std::move(o.unpacked)) {
+  o.fd = -1;
+}
+
+SegmentReader &SegmentReader::operator=(SegmentReader &&o) noexcept {
+  if (this != &o) {
+    if (fd >= 0)
+      ::close(fd);
+    id = o.id;
+    map = std::move(o.map);
+    map_len = o.map_len;
+    fd = o.fd;
+    block = std::move(o.block);
+    block_off = o.block_off;
+    compressor = std::move(o.compressor);
+    unpacked = std::move(o.unpacked);
+    o.fd = -1;
   }
+  return *this;
+}
+
+SegmentReader::~SegmentReader() {
+  if (fd >= 0)
+    ::close(fd);
 }
 
-// a yes or no function whether the key is really there or not
-bool Segment::lookup(uint64_t hash, SegmentOffset &out) {
-  // first a quick check in the bloom filter
-  if (!bf.maybeContains(hash))
+bool SegmentReader::record(size_t offset, size_t size, std::string_view &key,
+                           std::string_view &val) {
+  uint32_t recordLen;
+  if (size < sizeof(recordLen))
     return false;
-  auto opt = local_ind.get(hash);
-  if (opt.has_value()) {
-    out = {id, opt.value()};
-    return true;
+  const char *at;
+  if (map) {
+    if (offset + size > map_len)
+      return false;
+    at = map.get() + offset;
+  } else {
+    if (offset < block_off || offset + size > block_off + block.size()) {
+      // refill from offset on, at least a whole block
+      block.resize(std::max(BLOCK_SIZE, size));
+      ssize_t n = ::pread(fd, block.data(), block.size(), offset);
+      block.resize(n > 0 ? static_cast<size_t>(n) : 0);
+      block_off = offset;
+      if (block.size() < size)
+        return false;
+    }
+    at = block.data() + (offset - block_off);
+  }
+  std::memcpy(&recordLen, at, sizeof(recordLen));
+  if (sizeof(recordLen) + recordLen != size)
+    return false;
+  RecordHeader header;
+  bool crcOk;
+  if (!decodeRecord(at + sizeof(recordLen), recordLen, header, key, val,
+                    crcOk))
+    return false;
+  if (!(header.flags & RECORD_LIVE) || !crcOk)
+    return false;
+  if (header.codec != static_cast<uint8_t>(Codec::Raw)) {
+    if (!compressor ||
+        !compressor->decompress(Codec(header.codec), val, unpacked))
+      return false;
+    val = unpacked;
+  }
+  return true;
+}
+
+// walks every complete record in the file in append order starting at from,
+// a torn record ends the walk; returns the offset just past the last record
+size_t Segment::scan(const RecordVisitor &visit, size_t from) const {
+  RecordHeader header;
+  std::string_view key, val;
+  bool crcOk;
+  uint32_t recordLen;
+  size_t offset = from;
+
+  if (map) {
+    while (offset + sizeof(recordLen) <= map_len) {
+      std::memcpy(&recordLen, map + offset, sizeof(recordLen));
+      if (offset + sizeof(recordLen) + recordLen > map_len)
+        break;
+      if (!decodeRecord(map + offset + sizeof(recordLen), recordLen, header,
+                        key, val, crcOk))
+        break;
+      visit(offset, header, key, val, crcOk);
+      offset += sizeof(recordLen) + recordLen;
+    }
+    return offset;
+  }
+
+  std::ifstream in(seg_file_path, std::ios::binary);
+  in.seekg(static_cast<std::streamoff>(from));
+  std::vector<char> buf;
+  while (in.read(reinterpret_cast<char *>(&recordLen), sizeof(recordLen))) {
+    buf.resize(recordLen);
+    if (!in.read(buf.data(), recordLen))
+      break;
+    if (!decodeRecord(buf.data(), recordLen, header, key, val, crcOk))
+      break;
+    visit(offset, header, key, val, crcOk);
+    offset += sizeof(recordLen) + recordLen;
+  }
+  return offset;
+}
+
+// on-disk size of the record at offset, including its length prefix
+size_t Segment::recordSize(size_t offset) const {
+  uint32_t recordLen = 0;
+  if (map) {
+    if (offset + sizeof(recordLen) > map_len)
+      return 0;
+    std::memcpy(&recordLen, map + offset, sizeof(recordLen));
+    return sizeof(recordLen) + recordLen;
   }
-  return false;
+  if (::pread(fd, &recordLen, sizeof(recordLen), offset) !=
+      static_cast<ssize_t>(sizeof(recordLen)))
+    return 0;
+  return sizeof(recordLen) + recordLen;
 }
 
 } // namespace kv
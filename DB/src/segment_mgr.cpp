@@ -1,53 +1,728 @@
 #include "../include/kv/segment_manager.hpp"
+#include "../include/kv/hash_func.hpp"
+#include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
+#include <future>
+#include <iostream>
 #include <mutex>
 #include <string_view>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
 
 namespace kv {
-SegmentMgr::SegmentMgr(const std::string &dir, size_t seg_size)
-    : max_size(seg_size), dir(dir) {
+
+// the three files that make up a segment on disk
+static const char *SEGMENT_EXTS[] = {".kv", ".idx", ".bf"};
+
+static std::string segmentBase(const std::string &dir, size_t id) {
+  return dir + "/segment_" + std::to_string(id);
+}
+
+static void removeSegmentFiles(const std::string &dir, size_t id,
+                               const std::string &suffix = "") {
+  std::error_code ec;
+  for (const char *ext : SEGMENT_EXTS) {
+    fs::remove(segmentBase(dir, id) + ext + suffix, ec);
+  }
+}
+
+// true when enough of the segment is garbage to be worth rewriting
+static bool overThreshold(const Segment *s, double ratio) {
+  return ratio > 0 && s->bytes() > 0 &&
+         static_cast<double>(s->deadBytes()) >= ratio * s->bytes();
+}
+
+SegmentMgr::SegmentMgr(const std::string &dir, const Config &conf,
+                       std::shared_mutex &ind_mu, ThreadPool &pool,
+                       ValueCache &cache,
+                       std::shared_ptr<const Compressor> compressor)
+    : ind_mu(ind_mu), pool(pool), cache(cache),
+      compressor(std::move(compressor)), max_size(conf.segment_size),
+      bloom{conf.bloom_bits_kb * 1024, conf.bloom_fp_rate}, dir(dir),
+      dead_ratio(conf.compaction_dead_ratio), durability(conf.durability),
+      hash_fn(hashFunc(conf.hash)), verify_reads(conf.verify_reads),
+      keep_order(conf.ordered_index) {
   // creating directory if that doesnt exist
   std::filesystem::create_directories(dir);
-  // start with segment id = 1
-  current = new Segment(next_id++, dir, seg_size);
+  recover();
 }
 
-// destructor to delete all the segment objects
-SegmentMgr::~SegmentMgr() {
-  delete current;
-  for (auto *s : closed) {
-    delete s;
+// picks up whatever an earlier run left in dir: every segment_<id>.kv comes
+// back in id order, the highest one stays the active segment. Segments are
+// opened on the pool since each one loads its own snapshots independently
+void SegmentMgr::recover() {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<size_t> ids;
+  for (const auto &entry : fs::directory_iterator(dir)) {
+    std::string name = entry.path().filename().string();
+    if (entry.path().extension() == ".tmp") {
+      // a compaction or snapshot that never got renamed into place
+      std::error_code ec;
+      fs::remove(entry.path(), ec);
+      continue;
+    }
+    if (entry.path().extension() != ".kv" || name.rfind("segment_", 0) != 0)
+      continue;
+    std::string digits = entry.path().stem().string().substr(8);
+    if (digits.empty() ||
+        digits.find_first_not_of("0123456789") != std::string::npos)
+      continue;
+    ids.push_back(std::stoull(digits));
+  }
+  std::sort(ids.begin(), ids.end());
+
+  std::vector<std::future<std::shared_ptr<Segment>>> opening;
+  for (size_t i = 0; i + 1 < ids.size(); ++i) {
+    opening.push_back(pool.submit([this, id = ids[i]] {
+      auto s = std::make_shared<Segment>(id, dir, bloom, hash_fn, compressor);
+      s->seal();
+      return s;
+    }));
   }
+  // start with segment id = 1 on an empty directory
+  next_id = ids.empty() ? 1 : ids.back();
+  std::exception_ptr error;
+  try {
+    current =
+        std::make_shared<Segment>(next_id++, dir, bloom, hash_fn, compressor);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  for (auto &f : opening) {
+    try {
+      closed.push_back(f.get());
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+
+  buildKeyDir();
+  publishSegments();
+  if (ids.empty())
+    return;
+
+  auto account = [this](const std::shared_ptr<Segment> &s) {
+    const RecoveryTimes &t = s->recoveryTimes();
+    startup.segments++;
+    startup.bytes += s->bytes();
+    startup.scanned += t.scanned;
+    startup.index_ms += t.index_ms;
+    startup.bloom_ms += t.bloom_ms;
+    startup.scan_ms += t.scan_ms;
+  };
+  for (auto &s : closed) {
+    account(s);
+  }
+  account(current);
+  startup.wall_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+
+  double gb = startup.bytes / (1024.0 * 1024.0 * 1024.0);
+  std::cout << "recovered " << startup.segments << " segments ("
+            << startup.bytes / (1024 * 1024) << " MB) from " << dir << " in "
+            << startup.wall_ms << " ms";
+  if (gb > 0)
+    std::cout << " (" << startup.wall_ms / gb << " ms/GB)";
+  std::cout << "\n  index load " << startup.index_ms << " ms, bloom "
+            << startup.bloom_ms << " ms, tail scan " << startup.scan_ms
+            << " ms over " << startup.scanned / 1024 << " KB\n";
 }
 
-// appending the record to the file
+// replays the entries of every segment oldest first so the newest version of
+// each key ends up in the keydir and erased keys are not in it at all, then
+// derives the dead bytes of each segment from what the keydir still points at
+// and the tombstones of keys that are still erased. Closed segments hand their entries
+// over, only the active one keeps its own for the next seal
+void SegmentMgr::buildKeyDir() {
+  std::vector<std::shared_ptr<Segment>> all(closed);
+  all.push_back(current);
+  size_t total = 0;
+  for (auto &s : all) {
+    total += s->keyCount();
+  }
+  keydir.reserve(total);
+  for (auto &s : all) {
+    uint32_t id = static_cast<uint32_t>(s->getId());
+    s->visitIndex([&](const IndexEntry &e, std::string_view key) {
+      if (e.tombstone)
+        keydir.erase(key, e.hash);
+      else
+        keydir.put(key, e.hash, {e.offset, id, e.size});
+    });
+  }
+
+  std::unordered_map<size_t, size_t> live;
+  std::vector<std::string> keys;
+  if (keep_order)
+    keys.reserve(keydir.size());
+  keydir.for_each([&](std::string_view key, const KeyDirEntry &e) {
+    live[e.segment_id] += e.size;
+    if (keep_order)
+      keys.emplace_back(key);
+  });
+  for (auto &s : all) {
+    s->visitIndex([&](const IndexEntry &e, std::string_view key) {
+      if (e.tombstone && !keydir.get(key, e.hash))
+        live[s->getId()] += e.size;
+    });
+  }
+  std::sort(keys.begin(), keys.end());
+  ordered.build(std::move(keys));
+  for (auto &s : all) {
+    s->setDead(s->bytes() - std::min(s->bytes(), live[s->getId()]));
+  }
+  for (auto &s : closed) {
+    s->releaseIndex();
+    if (overThreshold(s.get(), dead_ratio))
+      compaction_due = true;
+  }
+}
+
+// hands point reads a fresh list of closed and current. Caller holds ind_mu
+// exclusively, and every keydir stripe too when keys move between segments
+void SegmentMgr::publishSegments() {
+  auto list = std::make_shared<SegmentList>();
+  list->segments.reserve(closed.size() + 1);
+  list->segments = closed;
+  list->segments.push_back(current);
+  std::atomic_store(&published,
+                    std::shared_ptr<const SegmentList>(std::move(list)));
+}
+
+std::shared_ptr<Segment> SegmentList::byId(size_t id) const {
+  auto it = std::lower_bound(
+      segments.begin(), segments.end(), id,
+      [](const std::shared_ptr<Segment> &s, size_t want) {
+        return s->getId() < want;
+      });
+  return it != segments.end() && (*it)->getId() == id ? *it : nullptr;
+}
+
+// the record we are about to shadow turns into dead bytes of its segment
+void SegmentMgr::markOverwritten(const KeyDirEntry &prev) {
+  Segment *s = segmentById(prev.segment_id);
+  if (!s)
+    return;
+  s->addDead(prev.size);
+  if (s != current.get() && overThreshold(s, dead_ratio))
+    compaction_due = true;
+}
+
+// ============================ GROUP COMMIT ===================================
+//
+// Each put queues a WriteReq. The first writer that finds no leader takes the
+// whole queue, encodes it into one buffer (crc done in memory), writes it with
+// a single write(), syncs according to the durability setting and only then
+// publishes the new offsets under the exclusive index lock. Everyone that
+// queued meanwhile just waits for the leader to mark them done, so with many
+// writers the per-put cost is one memcpy instead of a syscall and a flush.
+
+// appending the record to the file, returns once it is durable and indexed.
+// val is stored as given, codec says how it was compressed
 size_t SegmentMgr::append(uint64_t hash, std::string_view key,
-                          std::string_view val) {
+                          std::string_view val, Codec codec) {
+  WriteReq req{hash, key, val};
+  req.codec = codec;
+  submit(&req, 1);
+  return req.offset;
+}
+
+// appends all records of a write batch as one group: they land in the same
+// segment and the keydir publishes them under one index lock, so a reader
+// sees either none or all of them
+void SegmentMgr::appendBatch(std::vector<WriteReq> &reqs) {
+  if (reqs.empty())
+    return;
+  for (auto &r : reqs)
+    r.group_end = false;
+  reqs.back().group_end = true;
+  submit(reqs.data(), reqs.size());
+}
+
+// queues n requests back to back and returns once all of them are done. They
+// are queued under one q_mu hold, so the same leader takes all of them
+void SegmentMgr::submit(WriteReq *reqs, size_t n) {
+  WriteReq &last = reqs[n - 1];
+  std::unique_lock ql(q_mu);
+  for (size_t i = 0; i < n; i++)
+    queue.push_back(&reqs[i]);
+  while (!last.done) {
+    if (leader_active) {
+      q_cv.wait(ql);
+      continue;
+    }
+    leader_active = true;
+    std::vector<WriteReq *> batch(queue.begin(), queue.end());
+    queue.clear();
+    ql.unlock();
+    try {
+      commit(batch);
+    } catch (...) {
+      for (auto *r : batch) {
+        if (!r->written)
+          r->error = std::current_exception();
+      }
+    }
+    ql.lock();
+    leader_active = false;
+    for (auto *r : batch) {
+      r->done = true;
+    }
+    q_cv.notify_all();
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (reqs[i].error)
+      std::rethrow_exception(reqs[i].error);
+  }
+}
+
+// writes one batch, splitting it wherever the active segment fills up
+void SegmentMgr::commit(std::vector<WriteReq *> &batch) {
   std::lock_guard lock(mu);
+  std::vector<WriteReq *> pending;
+  batch_buf.clear();
+  for (auto *r : batch) {
+    r->offset = current->bytes() + batch_buf.size();
+    r->size = Segment::encodeRecord(batch_buf, r->key, r->val, r->tombstone,
+                                    r->codec);
+    pending.push_back(r);
+    // rotate if segment is too large, never inside a write batch
+    if (r->group_end && r->offset >= max_size) {
+      flushPending(pending);
+      rotate();
+    }
+  }
+  flushPending(pending);
+}
+
+// writes the buffered records of the active segment and makes them visible.
+// The stripes of every pending key are held for the whole publish, so a point
+// read of any key in a write batch waits until all of the batch is in
+void SegmentMgr::flushPending(std::vector<WriteReq *> &pending) {
+  if (pending.empty())
+    return;
+  size_t start = current->bytes();
+  current->writeRaw(batch_buf.data(), batch_buf.size());
+  batch_buf.clear();
+  if (durability == Durability::Sync) {
+    try {
+      current->sync();
+    } catch (...) {
+      // the writers are told it failed, so the records must not come back
+      current->truncate(start);
+      throw;
+    }
+  }
 
-  size_t off = current->appendRecord(hash, key, val);
+  uint32_t id = static_cast<uint32_t>(current->getId());
+  std::vector<uint64_t> hashes;
+  hashes.reserve(pending.size());
+  for (auto *r : pending)
+    hashes.push_back(r->hash);
+  std::unique_lock lock(ind_mu);
+  auto stripes = keydir.lockStripes(hashes);
+  for (auto *r : pending) {
+    auto prev = keydir.get(r->key, r->hash);
+    r->existed = prev.has_value();
+    if (prev)
+      markOverwritten(*prev);
+    if (r->tombstone) {
+      // the key leaves the keydir so lookups miss right away. The tombstone
+      // is not dead, it has to outlive the older versions on disk
+      if (prev)
+        keydir.erase(r->key, r->hash);
+      if (prev && keep_order)
+        ordered.erase(r->key);
+    } else {
+      if (!prev && keep_order)
+        ordered.insert(r->key);
+      keydir.put(r->key, r->hash,
+                 {r->offset, id, static_cast<uint32_t>(r->size)});
+    }
+    current->index(r->hash, r->key, r->offset, r->size, r->tombstone);
+    // under the index and stripe locks, so a reader never finds the old
+    // value cached next to the new one on disk
+    cache.invalidate(r->hash, r->key);
+    r->written = true;
+  }
+  pending.clear();
+}
+
+// seals the active segment and opens the next one, caller holds mu
+void SegmentMgr::rotate() {
+  if (durability == Durability::Flush)
+    current->sync();
+  auto next =
+      std::make_shared<Segment>(next_id++, dir, bloom, hash_fn, compressor);
+  std::shared_ptr<Segment> sealed = current;
+  // versions overwritten within the segment stay out of its snapshot, and
+  // so do tombstones of keys that were put again since. The filter grew in
+  // doublings while the segment filled, shrink it to the keys it ended up
+  // with. Only writers touch the keydir and the entries and they hold mu, so
+  // both happen before taking the index lock
+  uint32_t id = static_cast<uint32_t>(sealed->getId());
+  sealed->pruneIndex([&](const IndexEntry &e, std::string_view key) {
+    auto at = keydir.get(key, e.hash);
+    if (e.tombstone)
+      return !at;
+    return at && at->segment_id == id && at->offset == e.offset;
+  });
+  BloomFilter fitted = sealed->buildBloom(sealed->keyCount());
+  {
+    std::unique_lock lock(ind_mu);
+    sealed->seal();
+    sealed->setBloom(std::move(fitted));
+    closed.push_back(sealed);
+    if (overThreshold(sealed.get(), dead_ratio))
+      compaction_due = true;
+    // no key points into next yet, so the stripes can stay unlocked
+    current = next;
+    publishSegments();
+  }
+  // snapshot right away so a restart after a crash only rescans the tail of
+  // the active segment, the keydir has the entries from here on
+  sealed->releaseIndex();
+}
+
+// closed stays ordered by id, compaction hands the merged file the id of the
+// newest segment it replaces
+Segment *SegmentMgr::segmentById(size_t id) const {
+  if (current->getId() == id)
+    return current.get();
+  auto it = std::lower_bound(
+      closed.begin(), closed.end(), id,
+      [](const std::shared_ptr<Segment> &s, size_t want) {
+        return s->getId() < want;
+      });
+  return it != closed.end() && (*it)->getId() == id ? it->get() : nullptr;
+}
+
+// erases key by appending a tombstone through the group commit, false if it
+// had no value. Keys that are already missing get no tombstone at all
+bool SegmentMgr::remove(uint64_t hash, std::string_view key) {
+  {
+    std::shared_lock lock(keydir.stripeLock(hash));
+    if (!keydir.get(key, hash))
+      return false;
+  }
+  WriteReq req{hash, key, std::string_view()};
+  req.tombstone = true;
+  submit(&req, 1);
+  return req.existed;
+}
 
-  // rotate if segment is too large
-  if (static_cast<size_t>(off) >= max_size) {
-    closed.push_back(current);
-    current = new Segment(next_id++, dir, max_size);
+// reads the newest value for key, straight from the mapping when the segment
+// is sealed. Needs no lock from the caller: the entry and the segment list
+// are taken together under the key's stripe lock, so a compaction install
+// (which holds every stripe) is seen either entirely or not at all, and the
+// record is read after letting go, the list keeps its segment alive
+std::optional<ValueView> SegmentMgr::read(uint64_t hash,
+                                          std::string_view key) {
+  std::shared_ptr<Segment> s;
+  uint64_t offset;
+  {
+    std::shared_lock lock(keydir.stripeLock(hash));
+    auto at = keydir.get(key, hash);
+    if (!at)
+      return std::nullopt;
+    offset = at->offset;
+    s = std::atomic_load(&published)->byId(at->segment_id);
   }
-  return off;
+  if (!s)
+    return std::nullopt;
+  return s->read(offset, key, verify_reads);
 }
 
-// to check if certain element is present or not
-bool SegmentMgr::lookup(uint64_t hash, SegmentOffset &out) {
-  // Check active segment first
-  if (current->lookup(hash, out))
-    return true;
-  // Then check closed segments in order
-  for (auto *s : closed) {
-    if (s->lookup(hash, out))
+// reads every key of a multi-get under one index lock held by the caller. The
+// keydir is asked for all of them first, then the records are read segment by
+// segment in file order so the reads sweep each file once
+void SegmentMgr::readMany(std::vector<ReadReq> &reqs) {
+  struct Loc {
+    KeyDirEntry at;
+    size_t req;
+  };
+  std::vector<Loc> locs;
+  locs.reserve(reqs.size());
+  for (size_t i = 0; i < reqs.size(); i++) {
+    if (auto at = keydir.get(reqs[i].key, reqs[i].hash))
+      locs.push_back({*at, i});
+  }
+  std::sort(locs.begin(), locs.end(), [](const Loc &a, const Loc &b) {
+    return a.at.segment_id != b.at.segment_id
+               ? a.at.segment_id < b.at.segment_id
+               : a.at.offset < b.at.offset;
+  });
+  Segment *s = nullptr;
+  for (const auto &l : locs) {
+    if (!s || s->getId() != l.at.segment_id)
+      s = segmentById(l.at.segment_id);
+    if (s)
+      reqs[l.req].out =
+          s->read(l.at.offset, reqs[l.req].key, verify_reads);
+  }
+}
+
+// the keydir as it is right now, caller holds the index lock. Only the
+// locations are copied, the readers keep the files they point into alive
+ScanSnapshot SegmentMgr::snapshot() {
+  ScanSnapshot snap;
+  snap.live.reserve(keydir.size());
+  keydir.for_each([&](std::string_view, const KeyDirEntry &at) {
+    snap.live.push_back(at);
+  });
+  std::sort(snap.live.begin(), snap.live.end(),
+            [](const KeyDirEntry &a, const KeyDirEntry &b) {
+              return a.segment_id != b.segment_id
+                         ? a.segment_id < b.segment_id
+                         : a.offset < b.offset;
+            });
+  snap.segments.reserve(closed.size() + 1);
+  for (auto &s : closed)
+    snap.segments.push_back(s->reader());
+  snap.segments.push_back(current->reader());
+  return snap;
+}
+
+// the live pairs with keys in [start, end) in key order, at most limit of
+// them (0 for all), caller holds the index lock. Without the ordered index
+// this has to look at every key
+void SegmentMgr::range(std::string_view start, std::string_view end,
+                       size_t limit,
+                       std::vector<std::pair<std::string, ValueView>> &out) {
+  size_t found = 0;
+  auto visit = [&](std::string_view key) {
+    auto at = keydir.get(key, hash_fn(key));
+    Segment *s = at ? segmentById(at->segment_id) : nullptr;
+    if (!s)
       return true;
+    // a record that fails its crc is left out
+    if (auto val = s->read(at->offset, key)) {
+      out.emplace_back(std::string(key), std::move(*val));
+      ++found;
+    }
+    return limit == 0 || found < limit;
+  };
+  if (keep_order) {
+    ordered.range(start, end, visit);
+    return;
+  }
+  std::vector<std::string> keys;
+  keydir.for_each([&](std::string_view key, const KeyDirEntry &) {
+    if (key >= start && (end.empty() || key < end))
+      keys.emplace_back(key);
+  });
+  std::sort(keys.begin(), keys.end());
+  for (const auto &key : keys) {
+    if (!visit(key))
+      break;
   }
-  return false;
+}
+
+// ============================ COMPACTION =====================================
+//
+// A run goes plan -> merge -> install. Closed segments never change their
+// index once sealed, so merging only needs the snapshot taken by the plan and
+// can run next to reads and appends. Install swaps files under the exclusive
+// index lock so no reader holds an offset into a file being replaced.
+//
+// The merged segment takes the id (and so the place in lookup order) of the
+// newest victim. A record is copied only if it is the newest version of its
+// key across all segments, so anything sitting between two victims keeps
+// shadowing correctly and versions already replaced in the active segment are
+// dropped. Tombstones have no keydir entry, one is copied while its key is
+// still erased and a segment outside the merge may hold an older version.
+
+// picks every closed segment whose dead ratio crossed the threshold
+CompactionPlan SegmentMgr::planCompaction() {
+  std::lock_guard lock(mu);
+  compaction_due = false;
+  CompactionPlan plan;
+  for (auto &s : closed)
+    plan.snapshot.push_back(s.get());
+  for (size_t i = 0; i < closed.size(); ++i) {
+    if (overThreshold(closed[i].get(), dead_ratio))
+      plan.victims.push_back(i);
+  }
+  if (!plan.empty())
+    plan.out_id = closed[plan.victims.back()]->getId();
+  return plan;
+}
+
+// writes the live records of the victims into segment_<out_id>.*.tmp
+bool SegmentMgr::mergeSegments(CompactionPlan &plan) {
+  if (plan.empty())
+    return false;
+  auto &snap = plan.snapshot;
+
+  // leftovers of an earlier run that never got installed
+  removeSegmentFiles(dir, plan.out_id, ".tmp");
+  Segment out(plan.out_id, dir, bloom, hash_fn, compressor, ".tmp");
+
+  for (size_t v : plan.victims) {
+    Segment *seg = snap[v];
+    uint32_t seg_id = static_cast<uint32_t>(seg->getId());
+    seg->scan([&](size_t off, const RecordHeader &header, std::string_view key,
+                  std::string_view val, bool crcOk) {
+      uint64_t hash = hash_fn(key);
+      std::optional<KeyDirEntry> at;
+      {
+        // only the newest version anywhere, the active segment included,
+        // is worth copying
+        std::shared_lock lock(ind_mu);
+        at = keydir.get(key, hash);
+      }
+      if (!(header.flags & RECORD_LIVE)) {
+        // a tombstone only matters while its key is still erased (a newer
+        // put would shadow it anyway) and an older segment may still hold
+        // the key. Older victims count too: install unlinks them only after
+        // the merged file is in place, a crash in between leaves them on
+        // disk. It has no keydir entry to move
+        if (at || !crcOk)
+          return;
+        for (size_t j = 0; j < v; ++j) {
+          if (snap[j]->mayContain(hash)) {
+            out.appendRecord(hash, key, std::string_view(), true);
+            return;
+          }
+        }
+        return;
+      }
+      if (!at || at->segment_id != seg_id || at->offset != off)
+        return;
+      Relocation moved{std::string(key), hash, *at, std::nullopt};
+      if (!crcOk) {
+        // never give a corrupt record a fresh crc. Install drops the key,
+        // the tombstone keeps an older version from coming back after a
+        // restart
+        out.appendRecord(hash, key, std::string_view(), true);
+        plan.moved.push_back(moved);
+        return;
+      }
+      // the value moves as stored, compressed or not
+      size_t to = out.appendRecord(hash, key, val, false, Codec(header.codec));
+      moved.to = KeyDirEntry{to, static_cast<uint32_t>(plan.out_id),
+                             static_cast<uint32_t>(out.bytes() - to)};
+      plan.moved.push_back(moved);
+    });
+  }
+  out.setBloom(out.buildBloom(out.keyCount()));
+  // on disk before install renames it over a victim and unlinks the others
+  out.sync();
+  return true;
+}
+
+// swaps the merged segment in while holding readers off
+bool SegmentMgr::installCompaction(CompactionPlan &plan) {
+  std::lock_guard lock(mu);
+  std::unique_lock index_lock(ind_mu);
+
+  std::vector<Segment *> victims;
+  for (size_t v : plan.victims) {
+    victims.push_back(plan.snapshot[v]);
+  }
+  Segment *keep = victims.back();
+  auto isVictim = [&](Segment *s) {
+    return std::find(victims.begin(), victims.end(), s) != victims.end();
+  };
+
+  std::error_code ec;
+  std::string tmpData = segmentBase(dir, plan.out_id) + ".kv.tmp";
+  bool hasData = fs::exists(tmpData, ec) && fs::file_size(tmpData, ec) > 0;
+
+  // close the victims first, their destructors must not rewrite .idx/.bf.
+  // Point reads may still hold them, they keep reading the unlinked files
+  std::vector<size_t> dropped;
+  for (auto *s : victims) {
+    if (s != keep)
+      dropped.push_back(s->getId());
+    s->discard();
+  }
+
+  // the merged files replace the newest victim, only then are the older
+  // victims removed so a crash in between never loses live records. The old
+  // snapshots go first and the data file moves before the new ones, so a
+  // crash half way leaves a .kv without a matching snapshot, which recovery
+  // simply rebuilds
+  std::shared_ptr<Segment> merged;
+  if (hasData) {
+    std::string base = segmentBase(dir, plan.out_id);
+    fs::remove(base + ".idx", ec);
+    fs::remove(base + ".bf", ec);
+    for (const char *ext : SEGMENT_EXTS) {
+      std::string final = base + ext;
+      fs::rename(final + ".tmp", final, ec);
+    }
+    merged = std::make_shared<Segment>(plan.out_id, dir, bloom, hash_fn,
+                                       compressor);
+    merged->seal();
+    merged->releaseIndex();
+  } else {
+    removeSegmentFiles(dir, plan.out_id);
+    removeSegmentFiles(dir, plan.out_id, ".tmp");
+  }
+  // the merged file has to be in place for good before the older victims
+  // go, otherwise a power loss could keep the unlinks and lose the rename.
+  // If that cannot be made sure, the older victims stay on disk, recovery
+  // replays them under the newer merged file
+  if (utils::syncDir(dir)) {
+    for (size_t id : dropped) {
+      removeSegmentFiles(dir, id);
+    }
+    utils::syncDir(dir);
+  } else {
+    std::cerr << "warning: could not sync " << dir
+              << ", keeping the compacted segments\n";
+  }
+
+  // point reads take a key's entry and the segment list together, the moved
+  // keys and the new list have to reach them in one step. Nothing else
+  // changes the keydir while we hold mu, so only this part blocks them
+  auto stripes = keydir.lockAll();
+
+  // point the keys at their copies, unless a newer put moved them on, in
+  // which case the copy is dead on arrival
+  size_t stale = 0;
+  for (const Relocation &r : plan.moved) {
+    auto at = keydir.get(r.key, r.hash);
+    if (!at || !(*at == r.from)) {
+      if (r.to)
+        stale += r.to->size;
+      continue;
+    }
+    if (r.to)
+      keydir.put(r.key, r.hash, *r.to);
+    else if (keydir.erase(r.key, r.hash) && keep_order)
+      ordered.erase(r.key);
+  }
+  if (merged)
+    merged->setDead(stale);
+
+  std::vector<std::shared_ptr<Segment>> survivors;
+  for (auto &s : closed) {
+    if (s.get() == keep) {
+      if (merged)
+        survivors.push_back(merged);
+    } else if (!isVictim(s.get())) {
+      survivors.push_back(s);
+    }
+  }
+  closed = std::move(survivors);
+  publishSegments();
+  return true;
+}
+
+// drops whatever a merge left behind without touching the live segments
+void SegmentMgr::abortCompaction(CompactionPlan &plan) {
+  if (!plan.empty())
+    removeSegmentFiles(dir, plan.out_id, ".tmp");
 }
 
 } // namespace kv
@@ -1,189 +1,338 @@
 #include "../include/kv/storage_engine.hpp"
 #include "../include/kv/hash_func.hpp"
 #include "../include/kv/utils.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <ios>
 #include <iosfwd>
+#include <iostream>
 #include <mutex>
 #include <optional>
 #include <shared_mutex>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 
 namespace kv {
 
 StorageEngine::StorageEngine(const std::string &dir, size_t seg_size)
-    : seg_mgr(dir, seg_size), dir(dir) {}
+    : StorageEngine(dir, [seg_size] {
+        Config c;
+        c.segment_size = seg_size;
+        return c;
+      }()) {}
+
+// the shard count is fixed when a directory is first used, keys would land
+// in the wrong shard otherwise, so a stored count wins over the config
+static size_t shardCount(const std::string &dir, size_t wanted) {
+  std::filesystem::create_directories(dir);
+  std::string path = dir + "/SHARDS";
+  std::ifstream in(path);
+  size_t stored = 0;
+  if (in >> stored && stored > 0) {
+    if (stored != wanted)
+      std::cerr << "warning: " << dir << " was created with " << stored
+                << " shards, ignoring the configured " << wanted << '\n';
+    return stored;
+  }
+  // a directory from before sharding holds its segments at the top level,
+  // that is exactly the single shard layout
+  bool has_segments = false;
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    if (entry.path().extension() == ".kv")
+      has_segments = true;
+  }
+  size_t n = has_segments ? 1 : std::max<size_t>(1, wanted);
+  std::ofstream(path) << n << '\n';
+  return n;
+}
+
+// the hash is fixed when a directory is first used too, every stored hash,
+// bloom filter and the shard of each key depend on it. Directories from
+// before the choice existed (segments or a SHARDS file but no HASH file)
+// were written with fnv1a
+static HashAlgo hashAlgo(const std::string &dir, HashAlgo wanted) {
+  std::filesystem::create_directories(dir);
+  std::string path = dir + "/HASH";
+  std::ifstream in(path);
+  std::string stored;
+  if (in >> stored) {
+    if (stored == "fnv1a")
+      return HashAlgo::Fnv1a;
+    if (stored == "wyhash")
+      return HashAlgo::WyHash;
+    throw std::runtime_error(path + ": unknown hash '" + stored + "'");
+  }
+  bool has_data = std::filesystem::exists(dir + "/SHARDS");
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    if (entry.path().extension() == ".kv")
+      has_data = true;
+  }
+  HashAlgo algo = has_data ? HashAlgo::Fnv1a : wanted;
+  std::ofstream(path) << (algo == HashAlgo::Fnv1a ? "fnv1a" : "wyhash")
+                      << '\n';
+  return algo;
+}
+
+StorageEngine::StorageEngine(const std::string &dir, const Config &conf)
+    : StorageEngine(dir, conf, nullptr) {}
+
+StorageEngine::StorageEngine(const std::string &dir, const Config &conf,
+                             ThreadPool &pool)
+    : StorageEngine(dir, conf, &pool) {}
+
+StorageEngine::StorageEngine(const std::string &dir, const Config &conf,
+                             ThreadPool *shared)
+    : own_pool(shared ? nullptr
+                      : std::make_unique<ThreadPool>(
+                            std::max<size_t>(1, conf.thread_pool_sz))),
+      pool(shared ? *shared : *own_pool), dir(dir),
+      cache(conf.cache_size_mb * 1024 * 1024) {
+  // before shardCount, which writes SHARDS into a fresh directory
+  Config model = conf;
+  model.hash = hashAlgo(dir, conf.hash);
+  hash_fn = hashFunc(model.hash);
+  size_t n = shardCount(dir, conf.shards);
+  // one per model, the shards share its dictionary
+  compressor = std::make_shared<Compressor>(dir, conf);
+  for (size_t i = 0; i < n; ++i) {
+    // a single shard keeps the plain layout, more get a folder each
+    std::string shard_dir = n == 1 ? dir : dir + "/shard_" + std::to_string(i);
+    shards.push_back(std::make_unique<Shard>(shard_dir, model, pool, cache,
+                                              compressor));
+  }
+}
+
+// queued compactions point at the shards and the pool may be shared, so wait
+// for them before the segments go away
+StorageEngine::~StorageEngine() {
+  for (auto &shard : shards) {
+    std::lock_guard lock(shard->bg_mu);
+    if (shard->bg_compaction.valid())
+      shard->bg_compaction.wait();
+  }
+}
+
+// the shard owning a key, from the high bits of the mixed hash so it stays
+// independent of the bloom filter and index bucket bits
+size_t StorageEngine::shardIndex(uint64_t hash) const {
+  uint64_t mixed = hash * 0x9E3779B97F4A7C15ull;
+  return (mixed >> 32) % shards.size();
+}
 
 // the put functtion implementation
 void StorageEngine::put(const std::string &key, const std::string &val) {
   std::string_view k(key), v(val);
-  uint64_t hash = fnv1a(k);
-  // lock the that thing
-  std::unique_lock lock(ind_mu);
-  seg_mgr.append(hash, k, v);
+  uint64_t hash = hash_fn(k);
+  Shard &shard = shardFor(hash);
+  // compressed before the group commit, so the leader only copies bytes
+  std::string packed;
+  Codec codec = compressor->compress(v, packed);
+  if (codec != Codec::Raw)
+    v = packed;
+  // no engine lock here, the group commit in seg_mgr takes ind_mu only to
+  // publish the new offsets and drop the cached value
+  shard.seg_mgr.append(hash, k, v, codec);
+  if (shard.seg_mgr.compactionDue())
+    scheduleCompaction(shard);
 }
 
 // the get function
 std::optional<std::string> StorageEngine::get(const std::string &key) {
-  uint64_t hash = fnv1a(key);
-  SegmentOffset off;
-  {
-    // scope for shared lock
-    std::shared_lock lock(ind_mu);
-    if (!seg_mgr.lookup(hash, off)) {
-      return std::nullopt;
-    }
-  }
+  if (auto view = get_view(key))
+    return view->str();
+  return std::nullopt;
+}
 
-  // Build the filename for this segment
-  std::string path = dir + "/segment_" + std::to_string(off.segment_id) + ".kv";
-
-  // Open for read
-  std::ifstream in(path, std::ios::binary);
-  if (!in)
-    return std::nullopt;
-
-  // Seek to record start
-  in.seekg(off.offset);
-  if (!in)
-    return std::nullopt;
-
-  // Read recordLen, keyLen, valLen, flags, reserved
-  uint32_t recordLen, keyLen, valLen;
-  uint8_t flags, reserved;
-  in.read(reinterpret_cast<char *>(&recordLen), sizeof(recordLen));
-  in.read(reinterpret_cast<char *>(&keyLen), sizeof(keyLen));
-  in.read(reinterpret_cast<char *>(&valLen), sizeof(valLen));
-  in.read(reinterpret_cast<char *>(&flags), sizeof(flags));
-  in.read(reinterpret_cast<char *>(&reserved), sizeof(reserved));
-
-  // Read key and value
-  std::string keyBuf(keyLen, '\0');
-  std::string valBuf(valLen, '\0');
-  in.read(keyBuf.data(), keyLen);
-  in.read(valBuf.data(), valLen);
-
-  // If tombstone, treat as not found
-  if (flags == 0)
-    return std::nullopt;
-
-  // Optionally verify key matches
-  if (keyBuf != key)
-    return std::nullopt;
-
-  // Read and verify CRC
-  uint32_t storedCrc;
-  in.read(reinterpret_cast<char *>(&storedCrc), sizeof(storedCrc));
-
-  // Recompute CRC over the record payload
-  in.seekg(off.offset + sizeof(recordLen));
-  std::vector<uint8_t> payload(recordLen - sizeof(storedCrc));
-  in.read(reinterpret_cast<char *>(payload.data()), payload.size());
-  uint32_t computed = utils::crc32(payload.data(), payload.size());
-  if (computed != storedCrc) {
-    // data corruption!
-    return std::nullopt;
-  }
+std::optional<ValueView> StorageEngine::get_view(const std::string &key) {
+  uint64_t hash = hash_fn(key);
+  if (auto hit = cache.get(hash, key))
+    return hit;
+
+  uint64_t seen = cache.epoch(hash);
+  // no index lock, seg_mgr only takes the lock of the key's keydir stripe
+  // and the view keeps the bytes alive even if compaction drops the file
+  auto val = shardFor(hash).seg_mgr.read(hash, key);
+  if (val)
+    cache.fill(hash, key, val->value(), seen);
+  return val;
+}
 
-  return valBuf;
+bool StorageEngine::get_view(const std::string &key,
+                             const std::function<void(std::string_view)> &fn) {
+  auto view = get_view(key);
+  if (!view)
+    return false;
+  fn(view->value());
+  return true;
 }
 
-// erase functionality, makes the previosly appended record to 0, makes it
-// tombstone
-bool StorageEngine::erase(const std::string &key) {
-  uint64_t hash = fnv1a(key);
-  SegmentOffset off;
-  {
-    std::shared_lock lock(ind_mu);
-    if (!seg_mgr.lookup(hash, off)) {
-      return false;
+// each shard takes its index lock once for all of its keys and reads its
+// files in order. The cache is asked under that lock too, writes drop cached
+// values while publishing under it, so a write batch shows up whole or not at
+// all
+std::vector<std::optional<ValueView>>
+StorageEngine::multi_get(const std::vector<std::string> &keys) {
+  std::vector<std::optional<ValueView>> out(keys.size());
+  std::vector<std::vector<size_t>> per_shard(shards.size());
+  std::vector<uint64_t> hashes(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    hashes[i] = hash_fn(keys[i]);
+    per_shard[shardIndex(hashes[i])].push_back(i);
+  }
+  for (size_t s = 0; s < shards.size(); s++) {
+    if (per_shard[s].empty())
+      continue;
+    std::vector<ReadReq> reqs;
+    std::vector<size_t> slots;
+    std::vector<uint64_t> seen;
+    {
+      std::shared_lock lock(shards[s]->ind_mu);
+      for (size_t i : per_shard[s]) {
+        if ((out[i] = cache.get(hashes[i], keys[i])))
+          continue;
+        seen.push_back(cache.epoch(hashes[i]));
+        reqs.push_back({hashes[i], keys[i], std::nullopt});
+        slots.push_back(i);
+      }
+      shards[s]->seg_mgr.readMany(reqs);
+    }
+    for (size_t j = 0; j < reqs.size(); j++) {
+      if (reqs[j].out)
+        cache.fill(reqs[j].hash, reqs[j].key, reqs[j].out->value(), seen[j]);
+      out[slots[j]] = std::move(reqs[j].out);
     }
   }
+  return out;
+}
 
-  std::string path = dir + "/segment_" + std::to_string(off.segment_id) + ".kv";
-
-  // Open for update (read + write)
-  std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
-  if (!file)
-    return false;
+// the pairs of each shard go down as one group commit, so they share one
+// write and publish together
+void StorageEngine::write_batch(
+    const std::vector<std::pair<std::string, std::string>> &ops) {
+  std::vector<std::vector<WriteReq>> per_shard(shards.size());
+  // sized up front, the requests keep views of the compressed values
+  std::vector<std::string> packed(ops.size());
+  for (size_t i = 0; i < ops.size(); i++) {
+    const auto &[key, val] = ops[i];
+    uint64_t hash = hash_fn(key);
+    size_t s = shardIndex(hash);
+    WriteReq req{hash, key, val};
+    req.codec = compressor->compress(val, packed[i]);
+    if (req.codec != Codec::Raw)
+      req.val = packed[i];
+    per_shard[s].push_back(req);
+  }
+  for (size_t s = 0; s < shards.size(); s++) {
+    if (per_shard[s].empty())
+      continue;
+    shards[s]->seg_mgr.appendBatch(per_shard[s]);
+    if (shards[s]->seg_mgr.compactionDue())
+      scheduleCompaction(*shards[s]);
+  }
+}
 
-  // Seek to the record offset
-  file.seekg(off.offset);
-  if (!file)
+// erase functionality, appends a tombstone record for the key like a put
+// would and takes it out of the index, false if there was nothing to erase
+bool StorageEngine::erase(const std::string &key) {
+  uint64_t hash = hash_fn(key);
+  Shard &shard = shardFor(hash);
+  if (!shard.seg_mgr.remove(hash, key))
     return false;
+  if (shard.seg_mgr.compactionDue())
+    scheduleCompaction(shard);
+  return true;
+}
 
-  // Read header fields to locate the flag byte
-  uint32_t recordLen, keyLen, valLen;
-  uint8_t flags, reserved;
-  file.read(reinterpret_cast<char *>(&recordLen), sizeof(recordLen));
-  file.read(reinterpret_cast<char *>(&keyLen), sizeof(keyLen));
-  file.read(reinterpret_cast<char *>(&valLen), sizeof(valLen));
+std::vector<std::pair<std::string, ValueView>>
+StorageEngine::scan(const std::string &prefix, size_t limit) {
+  return range(prefix, prefixEnd(prefix), limit);
+}
 
-  std::streampos flag_pos = file.tellg(); // Position of the flag byte
-  file.read(reinterpret_cast<char *>(&flags), sizeof(flags));
-  file.read(reinterpret_cast<char *>(&reserved), sizeof(reserved));
+// the first string above every key with the prefix: bump the last byte that
+// can be bumped, nothing left means the prefix runs to the end
+std::string StorageEngine::prefixEnd(const std::string &prefix) {
+  std::string end = prefix;
+  while (!end.empty() && static_cast<unsigned char>(end.back()) == 0xff)
+    end.pop_back();
+  if (!end.empty())
+    ++end.back();
+  return end;
+}
 
-  // Only set tombstone if not already set
-  if (flags == 0)
-    return true; // Already deleted
+// every shard hands back its first limit pairs in order, the merged list is
+// cut down to limit again
+std::vector<std::pair<std::string, ValueView>>
+StorageEngine::range(const std::string &start, const std::string &end,
+                     size_t limit) {
+  std::vector<std::pair<std::string, ValueView>> out;
+  for (auto &shard : shards) {
+    std::shared_lock lock(shard->ind_mu);
+    shard->seg_mgr.range(start, end, limit, out);
+  }
+  if (shards.size() > 1) {
+    std::sort(out.begin(), out.end(), [](const auto &a, const auto &b) {
+      return a.first < b.first;
+    });
+    if (limit > 0 && out.size() > limit)
+      out.resize(limit);
+  }
+  return out;
+}
 
-  // Move file pointer back to flag position
-  file.seekp(flag_pos);
-  uint8_t tombstone = 0;
-  file.write(reinterpret_cast<char *>(&tombstone), sizeof(tombstone));
-  file.flush();
+// the shards are snapshotted together, each index lock is taken shared in
+// shard order and held until all of them are copied, so the result is one
+// point in time across the model
+ScanIterator StorageEngine::get_all() const {
+  std::vector<std::shared_lock<std::shared_mutex>> locks;
+  locks.reserve(shards.size());
+  for (const auto &shard : shards)
+    locks.emplace_back(shard->ind_mu);
+  std::vector<ScanSnapshot> snaps;
+  snaps.reserve(shards.size());
+  for (const auto &shard : shards)
+    snaps.push_back(shard->seg_mgr.snapshot());
+  return ScanIterator(std::move(snaps));
+}
 
-  return true;
+// compacts every shard, true if any of them swapped something in
+bool StorageEngine::compact() {
+  bool any = false;
+  for (auto &shard : shards) {
+    any = compact(*shard) || any;
+  }
+  return any;
 }
 
-std::vector<std::pair<std::string, std::string>>
-StorageEngine::get_all() const {
-  std::vector<std::pair<std::string, std::string>> results;
-
-  // This is inefficient as we'll read all files - in a real implementation,
-  // you'd want this to be optimized with some form of index
-  std::filesystem::path data_path(dir);
-  for (const auto &entry : std::filesystem::directory_iterator(data_path)) {
-    if (entry.path().extension() == ".kv") {
-      std::ifstream file(entry.path(), std::ios::binary);
-
-      while (file) {
-        // Read record header
-        uint32_t recordLen, keyLen, valLen;
-        uint8_t flags, reserved;
-
-        // Try to read record length
-        if (!file.read(reinterpret_cast<char *>(&recordLen), sizeof(recordLen)))
-          break;
-
-        // Read the rest of the header
-        file.read(reinterpret_cast<char *>(&keyLen), sizeof(keyLen));
-        file.read(reinterpret_cast<char *>(&valLen), sizeof(valLen));
-        file.read(reinterpret_cast<char *>(&flags), sizeof(flags));
-        file.read(reinterpret_cast<char *>(&reserved), sizeof(reserved));
-
-        // Read key and value
-        std::string key(keyLen, '\0');
-        std::string val(valLen, '\0');
-        file.read(key.data(), keyLen);
-        file.read(val.data(), valLen);
-
-        // Skip CRC
-        file.seekg(sizeof(uint32_t), std::ios::cur);
-
-        // If it's not a tombstone, add to results
-        if (flags != 0) {
-          results.emplace_back(key, val);
-        }
-      }
-    }
+// one compaction pass: plan and merge run next to normal traffic, only the
+// swap itself takes the exclusive index lock
+bool StorageEngine::compact(Shard &shard) {
+  std::lock_guard guard(shard.compact_mu);
+  SegmentMgr &seg_mgr = shard.seg_mgr;
+  CompactionPlan plan = seg_mgr.planCompaction();
+  if (plan.empty())
+    return false;
+  try {
+    seg_mgr.mergeSegments(plan);
+  } catch (...) {
+    seg_mgr.abortCompaction(plan);
+    throw;
   }
+  return seg_mgr.installCompaction(plan);
+}
 
-  return results;
+// queue a compaction on the pool unless one is already pending
+void StorageEngine::scheduleCompaction(Shard &shard) {
+  std::lock_guard lock(shard.bg_mu);
+  if (shard.bg_compaction.valid() &&
+      shard.bg_compaction.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready)
+    return;
+  shard.bg_compaction = pool.submit([this, &shard] { compact(shard); });
 }
 
 } // namespace kv
@@ -0,0 +1,108 @@
+#include "../include/kv/utils.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace utils {
+
+// the 8 tables of slicing-by-8 for a reflected polynomial: tables[0] is the
+// classic byte table, tables[k] advances a byte that sits k bytes further
+// back through k more zero bytes
+using SliceTables = std::array<std::array<uint32_t, 256>, 8>;
+
+static constexpr SliceTables sliceTables(uint32_t poly) {
+  SliceTables t{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc >> 1) ^ (crc & 1 ? poly : 0);
+    t[0][i] = crc;
+  }
+  for (size_t k = 1; k < 8; ++k) {
+    for (size_t i = 0; i < 256; ++i)
+      t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+  }
+  return t;
+}
+
+static constexpr SliceTables CRC32_TABLES = sliceTables(0xEDB88320u);
+static constexpr SliceTables CRC32C_TABLES = sliceTables(0x82F63B78u);
+
+// 8 bytes per step, one lookup per byte but no dependency between them. The
+// loads are little-endian, which is what the reflected tables expect
+static uint32_t sliceBy8(const SliceTables &t, uint32_t crc,
+                         const uint8_t *data, size_t length) {
+  while (length >= 8) {
+    uint32_t lo, hi;
+    std::memcpy(&lo, data, 4);
+    std::memcpy(&hi, data + 4, 4);
+    lo ^= crc;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^
+          t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+          t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    data += 8;
+    length -= 8;
+  }
+  while (length--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+  return crc;
+}
+
+uint32_t crc32(const uint8_t *data, size_t length) {
+  return sliceBy8(CRC32_TABLES, 0xFFFFFFFFu, data, length) ^ 0xFFFFFFFFu;
+}
+
+static uint32_t crc32cSoftware(const uint8_t *data, size_t length) {
+  return sliceBy8(CRC32C_TABLES, 0xFFFFFFFFu, data, length) ^ 0xFFFFFFFFu;
+}
+
+#if defined(__x86_64__)
+// the SSE4.2 crc32 instruction computes exactly CRC32C, 8 bytes at a time
+__attribute__((target("sse4.2"))) static uint32_t
+crc32cHardware(const uint8_t *data, size_t length) {
+  uint64_t crc = 0xFFFFFFFFu;
+  while (length >= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, 8);
+    crc = _mm_crc32_u64(crc, word);
+    data += 8;
+    length -= 8;
+  }
+  uint32_t tail = static_cast<uint32_t>(crc);
+  while (length--)
+    tail = _mm_crc32_u8(tail, *data++);
+  return tail ^ 0xFFFFFFFFu;
+}
+#endif
+
+// picked once, the first time a checksum is needed
+static uint32_t (*pickCrc32c())(const uint8_t *, size_t) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return crc32cHardware;
+#endif
+  return crc32cSoftware;
+}
+
+uint32_t crc32c(const uint8_t *data, size_t length) {
+  static const auto impl = pickCrc32c();
+  return impl(data, length);
+}
+
+bool syncDir(const std::string &dir) {
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return false;
+  bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+} // namespace utils
@@ -0,0 +1,175 @@
+#include "../include/kv/value_cache.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace kv {
+
+// odd multipliers to derive the sketch rows from the one key hash
+static constexpr uint64_t SKETCH_SEEDS[] = {
+    0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull,
+    0xD6E8FEB86659FD93ull};
+
+ValueCache::ValueCache(size_t capacity_bytes)
+    : capacity(capacity_bytes), shard_capacity(capacity_bytes / SHARDS) {
+  // roughly one counter per entry we could hold, at least 256
+  size_t expected = shard_capacity / (ENTRY_OVERHEAD + 64) + 1;
+  sketch_width = 256;
+  while (sketch_width < expected)
+    sketch_width <<= 1;
+  if (!enabled())
+    return;
+  for (auto &s : shards) {
+    s.sketch.assign(SKETCH_ROWS * sketch_width, 0);
+  }
+}
+
+size_t ValueCache::sketchIndex(uint64_t hash, size_t row) const {
+  uint64_t x = (hash ^ (hash >> 29)) * SKETCH_SEEDS[row];
+  return row * sketch_width + ((x >> 32) & (sketch_width - 1));
+}
+
+// count one request for hash, every counter halves once the sketch saw ten
+// times its width so old popularity fades
+void ValueCache::touch(Shard &s, uint64_t hash) {
+  for (size_t r = 0; r < SKETCH_ROWS; ++r) {
+    uint8_t &c = s.sketch[sketchIndex(hash, r)];
+    if (c < 15)
+      ++c;
+  }
+  if (++s.sketch_adds >= 10 * sketch_width) {
+    for (auto &c : s.sketch) {
+      c >>= 1;
+    }
+    s.sketch_adds = 0;
+  }
+}
+
+uint8_t ValueCache::frequency(const Shard &s, uint64_t hash) const {
+  uint8_t f = 15;
+  for (size_t r = 0; r < SKETCH_ROWS; ++r) {
+    f = std::min(f, s.sketch[sketchIndex(hash, r)]);
+  }
+  return f;
+}
+
+void ValueCache::removeSlot(Shard &s, size_t slot) {
+  Slot &e = s.slots[slot];
+  s.index.erase(e.key);
+  s.bytes -= e.key.size() + e.val->size() + ENTRY_OVERHEAD;
+  e = Slot{};
+  s.free_slots.push_back(slot);
+}
+
+std::optional<ValueView> ValueCache::get(uint64_t hash,
+                                         std::string_view key) {
+  if (!enabled())
+    return std::nullopt;
+  Shard &s = shardFor(hash);
+  std::lock_guard lock(s.mu);
+  touch(s, hash);
+  auto it = s.index.find(key);
+  if (it == s.index.end()) {
+    ++misses;
+    return std::nullopt;
+  }
+  ++hits;
+  Slot &e = s.slots[it->second];
+  e.referenced = true;
+  return ValueView(e.val, *e.val);
+}
+
+// taken before a disk read, handed back to fill()
+uint64_t ValueCache::epoch(uint64_t hash) {
+  Shard &s = shardFor(hash);
+  std::lock_guard lock(s.mu);
+  return s.epoch;
+}
+
+// offers a value read from disk, kept only if nothing was invalidated since
+// seen_epoch and the admission filter thinks it beats what it would evict
+void ValueCache::fill(uint64_t hash, std::string_view key,
+                      std::string_view val, uint64_t seen_epoch) {
+  if (!enabled())
+    return;
+  size_t cost = key.size() + val.size() + ENTRY_OVERHEAD;
+  if (cost > shard_capacity)
+    return;
+  Shard &s = shardFor(hash);
+  std::lock_guard lock(s.mu);
+  if (s.epoch != seen_epoch || s.index.count(key))
+    return;
+
+  uint8_t freq = frequency(s, hash);
+  while (s.bytes + cost > shard_capacity) {
+    // sweep the clock: referenced slots get a second chance
+    Slot *victim = nullptr;
+    while (!victim) {
+      s.hand = (s.hand + 1) % s.slots.size();
+      Slot &e = s.slots[s.hand];
+      if (!e.occupied)
+        continue;
+      if (e.referenced)
+        e.referenced = false;
+      else
+        victim = &e;
+    }
+    if (frequency(s, victim->hash) > freq) {
+      ++rejected;
+      return;
+    }
+    removeSlot(s, s.hand);
+    ++evictions;
+  }
+
+  size_t slot;
+  if (!s.free_slots.empty()) {
+    slot = s.free_slots.back();
+    s.free_slots.pop_back();
+  } else {
+    slot = s.slots.size();
+    s.slots.emplace_back();
+  }
+  Slot &e = s.slots[slot];
+  e.key.assign(key);
+  e.val = std::make_shared<const std::string>(val);
+  e.hash = hash;
+  e.referenced = false;
+  e.occupied = true;
+  s.index.emplace(e.key, slot);
+  s.bytes += cost;
+}
+
+// called after a write is visible, so a reader that fills afterwards either
+// read the new value or sees the epoch moved
+void ValueCache::invalidate(uint64_t hash, std::string_view key) {
+  if (!enabled())
+    return;
+  Shard &s = shardFor(hash);
+  std::lock_guard lock(s.mu);
+  ++s.epoch;
+  auto it = s.index.find(key);
+  if (it != s.index.end())
+    removeSlot(s, it->second);
+}
+
+CacheStats ValueCache::stats() {
+  CacheStats out;
+  out.hits = hits;
+  out.misses = misses;
+  out.evictions = evictions;
+  out.rejected = rejected;
+  for (auto &s : shards) {
+    std::lock_guard lock(s.mu);
+    out.entries += s.index.size();
+    out.bytes += s.bytes;
+  }
+  return out;
+}
+
+} // namespace kv